@@ -0,0 +1,282 @@
+#include "AsyncClient.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+
+AsyncClient::~AsyncClient() {
+    for(auto& conn : conns_) {
+        if(conn->alive) {
+            sel_.CancelFd(conn->fd);
+            close(conn->fd);
+        }
+    }
+}
+
+Task<bool> AsyncClient::Connect() {
+    size_t up = 0;
+    for(uint32_t i = 0; i < std::max(1u, config_.poolSize); ++i) {
+        auto conn = std::make_unique<Conn>();
+        conn->index = i;
+        if(co_await _Connect(*conn)) {
+            ++up;
+        }
+        conns_.push_back(std::move(conn));
+    }
+    INFO_LOG("client pool to [%s]:%u, %lu of %u connections up", config_.address.c_str(), config_.port, up, config_.poolSize);
+    co_return up > 0;
+}
+
+Task<bool> AsyncClient::_Connect(Conn& conn) {
+    struct sockaddr_storage serverAddress{};
+    socklen_t addrLen = 0;
+    if(AF_INET == config_.family) {
+        auto addr = (struct sockaddr_in*)&serverAddress;
+        addr->sin_family = AF_INET;
+        addr->sin_port   = htons(config_.port);
+        if(1 != inet_pton(AF_INET, config_.address.c_str(), &addr->sin_addr)) {
+            ERROR_LOG("invalid ipv4 address[%s]", config_.address.c_str());
+            co_return false;
+        }
+        addrLen = sizeof(struct sockaddr_in);
+    } else if(AF_INET6 == config_.family) {
+        auto addr = (struct sockaddr_in6*)&serverAddress;
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port   = htons(config_.port);
+        if(1 != inet_pton(AF_INET6, config_.address.c_str(), &addr->sin6_addr)) {
+            ERROR_LOG("invalid ipv6 address[%s]", config_.address.c_str());
+            co_return false;
+        }
+        addrLen = sizeof(struct sockaddr_in6);
+    } else if(AF_UNIX == config_.family) {
+        auto addr = (struct sockaddr_un*)&serverAddress;
+        addr->sun_family = AF_UNIX;
+        if(config_.address.empty() || config_.address.length() >= sizeof(addr->sun_path)) {
+            ERROR_LOG("invalid unix socket path[%s]", config_.address.c_str());
+            co_return false;
+        }
+        memcpy(addr->sun_path, config_.address.c_str(), config_.address.length());
+        addrLen = sizeof(struct sockaddr_un);
+    } else {
+        ERROR_LOG("unsupported client family[%d]", config_.family);
+        co_return false;
+    }
+
+    int fd = socket(config_.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(-1 == fd) {
+        ERROR_LOG("create socket failed, errno: %d, error: %s", errno, strerror(errno));
+        co_return false;
+    }
+    int32_t opt = 1;
+    if(AF_UNIX != config_.family && -1 == setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt))) {
+        WARN_LOG("setsockopt TCP_NODELAY failed, errno: %d, error: %s", errno, strerror(errno));
+    }
+
+    if(-1 == connect(fd, (struct sockaddr *)&serverAddress, addrLen)) {
+        if(EINPROGRESS != errno && EAGAIN != errno) {
+            ERROR_LOG("connect failed, errno: %d, error: %s", errno, strerror(errno));
+            close(fd);
+            co_return false;
+        }
+        // the outcome of a non-blocking connect shows up as writability plus SO_ERROR
+        int err = 0;
+        socklen_t errLen = sizeof(err);
+        if(!co_await OnWritable{&sel_, fd} || -1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) || 0 != err) {
+            ERROR_LOG("connect failed, error: %s", strerror(err));
+            sel_.CancelFd(fd);
+            close(fd);
+            co_return false;
+        }
+    }
+
+    conn.fd     = fd;
+    conn.alive  = true;
+    conn.reader = ReadLoop(&conn);
+    co_return true;
+}
+
+Task<CallResult> AsyncClient::Call(MsgType type, std::string payload, std::chrono::milliseconds timeout) {
+    Conn* conn = _Pick();
+    if(!conn) {
+        co_return CallResult{false, MsgType::UNKNOWN, {}, "not connected"};
+    }
+
+    uint32_t msgId = conn->nextMsgId++;
+    if(0 == conn->nextMsgId) {
+        conn->nextMsgId = 1;
+    }
+    MsgHead head{msgId, type, (uint32_t)payload.length()};
+    conn->next.append((const char*)&head, sizeof(head));
+    conn->next.append(payload);
+
+    PendingCall call;
+    conn->pending[msgId] = &call;
+    auto when = std::chrono::steady_clock::now() + (timeout.count() > 0 ? timeout : config_.timeout);
+    deadlines_.push_back(Deadline{when, conn->index, msgId});
+    std::push_heap(deadlines_.begin(), deadlines_.end(), _Later);
+
+    co_await CallAwaiter{&call};
+    co_return std::move(call.result);
+}
+
+AsyncClient::Conn* AsyncClient::_Pick() {
+    Conn* best = nullptr;
+    for(auto& conn : conns_) {
+        if(conn->alive && (!best || conn->pending.size() < best->pending.size())) {
+            best = conn.get();
+        }
+    }
+    return best;
+}
+
+void AsyncClient::Poll() {
+    for(auto& conn : conns_) {
+        if(conn->alive && !conn->next.empty() && conn->flusher.Done()) {
+            conn->flusher = FlushLoop(conn.get());
+        }
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    while(!deadlines_.empty() && deadlines_.front().when <= now) {
+        std::pop_heap(deadlines_.begin(), deadlines_.end(), _Later);
+        Deadline expired = deadlines_.back();
+        deadlines_.pop_back();
+        // calls that completed in time left their entry behind, it finds nothing here
+        Conn& conn = *conns_[expired.conn];
+        auto itr = conn.pending.find(expired.msgId);
+        if(itr == conn.pending.end()) {
+            continue;
+        }
+        PendingCall* call = itr->second;
+        conn.pending.erase(itr);
+        call->result.error = "timeout";
+        _Finish(conn, call);
+    }
+
+    sel_.RunOnce();
+}
+
+Task<void> AsyncClient::FlushLoop(Conn* conn) {
+    while(conn->alive && !conn->next.empty()) {
+        conn->sending.swap(conn->next);
+        bool sent = co_await SendAll(&sel_, conn->fd, conn->sending.data(), conn->sending.length());
+        conn->sending.clear();
+        if(!sent) {
+            _Fail(*conn, "send failed");
+            break;
+        }
+    }
+    co_return;
+}
+
+Task<void> AsyncClient::ReadLoop(Conn* conn) {
+    std::string buf(RECV_BUFFER_SIZE, '\0');
+    size_t used = 0;
+    const char* error = "connection closed";
+    while(conn->alive) {
+        ssize_t len = recv(conn->fd, buf.data() + used, buf.length() - used, 0);
+        if(len < 0) {
+            if(EINTR == errno) {
+                continue;
+            }
+            if(EAGAIN == errno || EWOULDBLOCK == errno) {
+                if(!co_await OnReadable{&sel_, conn->fd}) {
+                    break;
+                }
+                continue;
+            }
+            error = "recv failed";
+            break;
+        }
+        if(0 == len) {
+            break;
+        }
+        used += len;
+
+        size_t parsed = 0;
+        MsgHead head;
+        while(used - parsed >= sizeof(MsgHead)) {
+            memcpy(&head, buf.data() + parsed, sizeof(head));
+            if(used - parsed - sizeof(MsgHead) < head.dataLen) {
+                break;
+            }
+            _Complete(*conn, head, buf.data() + parsed + sizeof(MsgHead));
+            parsed += sizeof(MsgHead) + head.dataLen;
+        }
+        if(parsed > 0) {
+            memmove(buf.data(), buf.data() + parsed, used - parsed);
+            used -= parsed;
+        }
+
+        // a reply larger than the buffer grows it to fit, once its head is in
+        if(used >= sizeof(MsgHead)) {
+            memcpy(&head, buf.data(), sizeof(head));
+            if(head.dataLen > MAX_REPLY_SIZE) {
+                error = "reply too large";
+                break;
+            }
+            if(sizeof(MsgHead) + head.dataLen > buf.length()) {
+                buf.resize(sizeof(MsgHead) + head.dataLen);
+            }
+        }
+    }
+    if(conn->alive) {
+        _Fail(*conn, error);
+    }
+    co_return;
+}
+
+void AsyncClient::_Complete(Conn& conn, const MsgHead& head, const char* body) {
+    if(0 == head.msgId) {
+        if(MsgType::MESSAGE == head.type && onMessage_) {
+            onMessage_(std::string(body, head.dataLen));
+        }
+        return;
+    }
+    auto itr = conn.pending.find(head.msgId);
+    if(itr == conn.pending.end()) {
+        INFO_LOG("client fd[%d] reply msgId[%u] has no waiting call, dropped", conn.fd, head.msgId);
+        return;
+    }
+    PendingCall* call = itr->second;
+    call->result.body.append(body, head.dataLen);
+    if(MsgType::STREAM_CHUNK == head.type) {
+        return;
+    }
+    conn.pending.erase(itr);
+    call->result.ok   = true;
+    call->result.type = head.type;
+    _Finish(conn, call);
+}
+
+void AsyncClient::_Finish(Conn& conn, PendingCall* call) {
+    // resumed from the ready queue, never from inside the reader's parse loop
+    sel_.Ready(conn.fd, call->h);
+}
+
+void AsyncClient::_Fail(Conn& conn, const char* error) {
+    WARN_LOG("client fd[%d] %s, failing %lu calls", conn.fd, error, conn.pending.size());
+    conn.alive = false;
+    sel_.CancelFd(conn.fd);
+    close(conn.fd);
+    for(auto& pending : conn.pending) {
+        pending.second->result.error = error;
+        _Finish(conn, pending.second);
+    }
+    conn.pending.clear();
+    conn.next.clear();
+}
+
+size_t AsyncClient::Connected() const {
+    return std::count_if(conns_.begin(), conns_.end(), [](const auto& conn) { return conn->alive; });
+}
+
+size_t AsyncClient::InFlight() const {
+    size_t inFlight = 0;
+    for(auto& conn : conns_) {
+        inFlight += conn->pending.size();
+    }
+    return inFlight;
+}
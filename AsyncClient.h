@@ -0,0 +1,127 @@
+#pragma once
+
+#include "CoroutineServer.h"
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct ClientConfig {
+    int family{AF_INET};        // AF_INET, AF_INET6 or AF_UNIX
+    std::string address{"127.0.0.1"};   // server ip, or the socket path for AF_UNIX
+    uint16_t port{0};
+    uint32_t poolSize{4};
+    std::chrono::milliseconds timeout{1000};    // for calls that do not bring their own
+};
+
+// ok is false when the call timed out or its connection broke, error says which.
+struct CallResult {
+    bool ok{false};
+    MsgType type{MsgType::UNKNOWN};
+    std::string body;
+    std::string error;
+};
+
+// Pipelining client for MsgHead servers, driven by its own Selector on the calling thread.
+// Calls go to the connection of the pool with the fewest in flight and are matched to their
+// replies by msgId, so any number of them may be outstanding. Frames of all calls issued
+// within one tick leave in a single send per connection. Chunked replies are collected
+// into one body; MESSAGE pushes go to the OnMessage callback.
+class AsyncClient {
+    static constexpr uint32_t RECV_BUFFER_SIZE = 256 << 10;
+    static constexpr uint32_t MAX_REPLY_SIZE = 256 << 20;
+public:
+    explicit AsyncClient(const ClientConfig& config) : config_(config) {}
+    ~AsyncClient();
+
+    AsyncClient(const AsyncClient&) = delete;
+    AsyncClient& operator=(const AsyncClient&) = delete;
+
+    // Opens the pool. True if at least one connection is up.
+    Task<bool> Connect();
+
+    // A zero timeout takes the configured one. The returned task has to be kept until it is done.
+    Task<CallResult> Call(MsgType type, std::string payload, std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+    void OnMessage(std::function<void(const std::string&)> callback) { onMessage_ = std::move(callback); }
+
+    // One reactor tick: sends what the calls queued, expires calls past their deadline and
+    // resumes whatever is ready. Deadlines are checked once per tick, so a timeout may fire
+    // up to one select wait late.
+    void Poll();
+
+    // Drives the client until task is done.
+    template <typename T>
+    T Wait(Task<T>& task) {
+        while(!task.Done()) {
+            Poll();
+        }
+        return task.get();
+    }
+
+    size_t Connected() const;
+
+    size_t InFlight() const;
+
+private:
+    struct PendingCall {
+        std::coroutine_handle<> h{};
+        CallResult result;
+    };
+
+    struct Conn {
+        uint32_t index{0};
+        int fd{INVALID_SOCKET_VALUE};
+        bool alive{false};
+        uint32_t nextMsgId{1};      // 0 is what pushes carry
+        std::unordered_map<uint32_t, PendingCall*> pending;
+        std::string next;           // frames queued since the last flush
+        std::string sending;
+        Task<void> reader;
+        Task<void> flusher;
+    };
+
+    struct Deadline {
+        std::chrono::steady_clock::time_point when;
+        uint32_t conn;
+        uint32_t msgId;
+    };
+
+    struct CallAwaiter {
+        PendingCall* call;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) { call->h = h; }
+        void await_resume() const noexcept {}
+    };
+
+    static bool _Later(const Deadline& a, const Deadline& b) { return a.when > b.when; }
+
+    Task<bool> _Connect(Conn& conn);
+
+    Task<void> ReadLoop(Conn* conn);
+
+    // Sends conn->next until nothing new was queued behind it.
+    Task<void> FlushLoop(Conn* conn);
+
+    void _Complete(Conn& conn, const MsgHead& head, const char* body);
+
+    void _Finish(Conn& conn, PendingCall* call);
+
+    // Closes conn and fails every call still waiting on it.
+    void _Fail(Conn& conn, const char* error);
+
+    Conn* _Pick();
+
+private:
+    Selector sel_;
+
+    ClientConfig config_;
+
+    std::vector<std::unique_ptr<Conn>> conns_;
+
+    std::vector<Deadline> deadlines_;
+
+    std::function<void(const std::string&)> onMessage_;
+};
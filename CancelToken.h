@@ -0,0 +1,92 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Cooperative cancellation for coroutines running on one reactor thread. Cancelling a
+// token cancels its children and runs their callbacks once, which typically wake
+// whatever the owner is suspended on so it can unwind. A default constructed token
+// is never cancelled.
+class CancelToken {
+public:
+    CancelToken() = default;
+
+    static CancelToken Create() {
+        CancelToken token;
+        token.state_ = std::make_shared<State>();
+        return token;
+    }
+
+    // Cancelled together with this token, or on its own.
+    CancelToken Child() const {
+        CancelToken child = Create();
+        if(state_) {
+            if(state_->cancelled) {
+                child.state_->cancelled = true;
+            } else {
+                _PruneChildren();
+                state_->children.push_back(child.state_);
+            }
+        }
+        return child;
+    }
+
+    bool Cancelled() const { return state_ && state_->cancelled; }
+
+    void Cancel() {
+        if(state_) {
+            _Cancel(state_);
+        }
+    }
+
+    // Runs cb on cancellation, right away if that already happened.
+    void OnCancel(std::function<void()> cb) {
+        if(!state_) {
+            return;
+        }
+        if(state_->cancelled) {
+            cb();
+        } else {
+            state_->callbacks.push_back(std::move(cb));
+        }
+    }
+
+private:
+    struct State {
+        bool cancelled{false};
+        std::vector<std::weak_ptr<State>> children;
+        std::vector<std::function<void()>> callbacks;
+        size_t pruneAt{16};
+    };
+
+    static void _Cancel(const std::shared_ptr<State>& state) {
+        if(state->cancelled) {
+            return;
+        }
+        state->cancelled = true;
+        auto callbacks = std::move(state->callbacks);
+        auto children  = std::move(state->children);
+        for(auto& cb : callbacks) {
+            cb();
+        }
+        for(auto& weak : children) {
+            if(auto child = weak.lock()) {
+                _Cancel(child);
+            }
+        }
+    }
+
+    // finished connections leave expired entries behind, drop them once the list doubled
+    void _PruneChildren() const {
+        auto& children = state_->children;
+        if(children.size() < state_->pruneAt) {
+            return;
+        }
+        std::erase_if(children, [](const std::weak_ptr<State>& weak) { return weak.expired(); });
+        state_->pruneAt = std::max<size_t>(16, children.size() * 2);
+    }
+
+private:
+    std::shared_ptr<State> state_;
+};
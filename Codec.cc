@@ -0,0 +1,60 @@
+#include "Codec.h"
+#include "Logger.h"
+#include "RespCodec.h"
+#include <cstring>
+
+std::unique_ptr<Codec> Codec::Create(WireCodec kind, uint32_t maxFrame) {
+    switch(kind) {
+        case CODEC_MSG_HEAD:
+            return std::make_unique<MsgHeadCodec>(maxFrame);
+        case CODEC_RESP:
+            return std::make_unique<RespCodec>(maxFrame);
+    }
+    return nullptr;
+}
+
+int64_t MsgHeadCodec::Decode(const char* data, size_t len, CodecRequest& req, std::string& payload) {
+    if(len < sizeof(MsgHead)) {
+        return 0;
+    }
+    MsgHead head;
+    memcpy(&head, data, sizeof(head));
+    uint32_t rawType;
+    memcpy(&rawType, &head.type, sizeof(rawType));
+    if(rawType & MSG_EXT_FLAG) {
+        ERROR_LOG("header extension without negotiation, msgId[%u]", head.msgId);
+        return -1;
+    }
+    if(head.dataLen > maxFrame_ - sizeof(MsgHead)) {
+        ERROR_LOG("request data len: %u larger than max buffer size: %u", head.dataLen, maxFrame_);
+        return -1;
+    }
+    if(len - sizeof(MsgHead) < head.dataLen) {
+        return 0;
+    }
+
+    req.msgId = head.msgId;
+    req.type  = head.type;
+    req.local = false;
+    payload.assign(data + sizeof(MsgHead), head.dataLen);
+    return sizeof(MsgHead) + head.dataLen;
+}
+
+void MsgHeadCodec::Encode(const CodecRequest& req, const std::string& respMsg, std::string& out) {
+    size_t pos = out.length();
+    out.resize(pos + sizeof(MsgHead) + respMsg.length());
+    MsgHead head{req.msgId, req.type, (uint32_t)respMsg.length()};
+    memcpy(out.data() + pos, &head, sizeof(head));
+    memcpy(out.data() + pos + sizeof(MsgHead), respMsg.data(), respMsg.length());
+}
+
+void MsgHeadCodec::EncodeFrame(uint32_t msgId, MsgType type, const std::string& respMsg, uint32_t bodyLen, std::string& out) {
+    out.resize(sizeof(MsgHead) + respMsg.length());
+
+    auto head = (PMsgHead)out.data();
+    head->msgId   = msgId;
+    head->type    = type;
+    head->dataLen = respMsg.length() + bodyLen;
+
+    memcpy(out.data() + sizeof(MsgHead), respMsg.data(), respMsg.length());
+}
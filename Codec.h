@@ -0,0 +1,52 @@
+#pragma once
+
+#include "MsgType.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Wire format a listener speaks. Every codec feeds the same RequestHandler dispatch.
+enum WireCodec {
+    CODEC_MSG_HEAD = 0,     // MsgHead frames, with the HELLO negotiated extensions
+    CODEC_RESP     = 1      // redis protocol, mapped onto the KV request types
+};
+
+struct CodecRequest {
+    uint32_t msgId{0};      // opaque to the session, handed back to Encode to correlate the reply
+    MsgType  type{MsgType::UNKNOWN};
+    bool     local{false};  // answered by the codec itself, the handler is skipped
+};
+
+// Turns bytes from the connection buffer into handler requests and handler replies back
+// into bytes. Decode works in place on whatever has arrived so far: a partial request
+// returns 0 and the next call, with the same request start and more bytes behind it,
+// resumes where the previous one stopped. A codec instance belongs to one connection.
+class Codec {
+public:
+    virtual ~Codec() = default;
+
+    // Returns the bytes the request spans once it is complete, 0 if more are needed and
+    // -1 if the stream is malformed. payload is assigned in place and keeps its capacity.
+    virtual int64_t Decode(const char* data, size_t len, CodecRequest& req, std::string& payload) = 0;
+
+    // Appends the reply to out, so replies to pipelined requests leave in one send.
+    virtual void Encode(const CodecRequest& req, const std::string& respMsg, std::string& out) = 0;
+
+    static std::unique_ptr<Codec> Create(WireCodec kind, uint32_t maxFrame);
+};
+
+// Plain MsgHead frames without header extensions.
+class MsgHeadCodec : public Codec {
+public:
+    explicit MsgHeadCodec(uint32_t maxFrame) : maxFrame_(maxFrame) {}
+
+    int64_t Decode(const char* data, size_t len, CodecRequest& req, std::string& payload) override;
+
+    void Encode(const CodecRequest& req, const std::string& respMsg, std::string& out) override;
+
+    // bodyLen counts body bytes sent after the frame, outside of respMsg.
+    static void EncodeFrame(uint32_t msgId, MsgType type, const std::string& respMsg, uint32_t bodyLen, std::string& out);
+
+private:
+    uint32_t maxFrame_;
+};
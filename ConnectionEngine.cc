@@ -0,0 +1,124 @@
+#include "ConnectionEngine.h"
+#include "Logger.h"
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int CreateListenSocket(const ListenerConfig& config) {
+    struct sockaddr_storage serverAddress{};
+    socklen_t addrLen = 0;
+    if(AF_INET == config.family) {
+        auto addr = (struct sockaddr_in*)&serverAddress;
+        addr->sin_family = AF_INET;
+        addr->sin_port   = htons(config.port);
+        addr->sin_addr.s_addr = INADDR_ANY;
+        if(!config.address.empty() && 1 != inet_pton(AF_INET, config.address.c_str(), &addr->sin_addr)) {
+            ERROR_LOG("invalid ipv4 address[%s]", config.address.c_str());
+            return INVALID_SOCKET_VALUE;
+        }
+        addrLen = sizeof(struct sockaddr_in);
+    } else if(AF_INET6 == config.family) {
+        auto addr = (struct sockaddr_in6*)&serverAddress;
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port   = htons(config.port);
+        addr->sin6_addr   = in6addr_any;
+        if(!config.address.empty() && 1 != inet_pton(AF_INET6, config.address.c_str(), &addr->sin6_addr)) {
+            ERROR_LOG("invalid ipv6 address[%s]", config.address.c_str());
+            return INVALID_SOCKET_VALUE;
+        }
+        addrLen = sizeof(struct sockaddr_in6);
+    } else if(AF_UNIX == config.family) {
+        auto addr = (struct sockaddr_un*)&serverAddress;
+        addr->sun_family = AF_UNIX;
+        if(config.address.empty() || config.address.length() >= sizeof(addr->sun_path)) {
+            ERROR_LOG("invalid unix socket path[%s]", config.address.c_str());
+            return INVALID_SOCKET_VALUE;
+        }
+        memcpy(addr->sun_path, config.address.c_str(), config.address.length());
+        addrLen = sizeof(struct sockaddr_un);
+        unlink(config.address.c_str());
+    } else {
+        ERROR_LOG("unsupported listener family[%d]", config.family);
+        return INVALID_SOCKET_VALUE;
+    }
+
+    int listenFd = socket(config.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(-1 == listenFd) {
+        ERROR_LOG("create socket failed, errno: %d, error: %s", errno, strerror(errno));
+        return INVALID_SOCKET_VALUE;
+    }
+
+    int32_t opt = 1;
+    if(AF_UNIX != config.family) {
+        if(-1 == setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+            ERROR_LOG("setsockopt SO_REUSEADDR failed, errno: %d, error: %s", errno, strerror(errno));
+            close(listenFd);
+            return INVALID_SOCKET_VALUE;
+        }
+
+        if(-1 == setsockopt(listenFd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt))) {
+            ERROR_LOG("setsockopt TCP_NODELAY failed, errno: %d, error: %s", errno, strerror(errno));
+            close(listenFd);
+            return INVALID_SOCKET_VALUE;
+        }
+    }
+
+    // keep the v6 socket off v4 so both families can share one port
+    if(AF_INET6 == config.family && -1 == setsockopt(listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt))) {
+        ERROR_LOG("setsockopt IPV6_V6ONLY failed, errno: %d, error: %s", errno, strerror(errno));
+        close(listenFd);
+        return INVALID_SOCKET_VALUE;
+    }
+
+    if(-1 == bind(listenFd, (struct sockaddr *)&serverAddress, addrLen)) {
+        ERROR_LOG("bind failed, errno: %d, error: %s", errno, strerror(errno));
+        close(listenFd);
+        return INVALID_SOCKET_VALUE;
+    }
+
+    // room for a reconnect storm, the kernel caps it at net.core.somaxconn
+    if(-1 == listen(listenFd, SOMAXCONN)) {
+        ERROR_LOG("listen failed, errno: %d, error: %s", errno, strerror(errno));
+        close(listenFd);
+        return INVALID_SOCKET_VALUE;
+    }
+
+    return listenFd;
+}
+
+void Connection::Dispatch(const CodecRequest& req, std::string& respMsg) {
+    respMsg.clear();
+    if(!req.local) {
+        handler_.HandleRequest(req.type, payload_, respMsg);
+    }
+}
+
+int64_t Connection::Serve(const char* data, size_t len) {
+    size_t parsed = 0;
+    while(parsed < len) {
+        CodecRequest req;
+        int64_t reqLen = Next(data + parsed, len - parsed, req);
+        if(reqLen < 0) {
+            return -1;
+        }
+        if(0 == reqLen) {
+            break;
+        }
+        parsed += reqLen;
+        Dispatch(req, respMsg_);
+        Reply(req, respMsg_);
+    }
+    return parsed;
+}
+
+void Connection::Trim(size_t keepSize) {
+    for(auto buf : {&payload_, &respMsg_, &out_}) {
+        if(buf->capacity() > keepSize) {
+            std::string().swap(*buf);
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "Codec.h"
+#include "RequestHandler.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+
+const int INVALID_SOCKET_VALUE = -1;
+
+struct ListenerConfig {
+    int family{AF_INET};        // AF_INET, AF_INET6 or AF_UNIX
+    std::string address;        // bind ip (empty for any), or the socket path for AF_UNIX
+    uint16_t port{0};
+    WireCodec codec{CODEC_MSG_HEAD};
+};
+
+// A non-blocking, close-on-exec socket bound and listening as config says, INVALID_SOCKET_VALUE on failure.
+// A unix socket path left behind by an earlier run is unlinked first.
+int CreateListenSocket(const ListenerConfig& config);
+
+// One connection's requests, whatever front end runs it: the front end reads into its own buffer,
+// Next decodes a request at its front, Dispatch runs the handler and Reply frames the answer into
+// Out() for the front end to write. Front ends with nothing to do in between call Serve.
+class Connection {
+public:
+    Connection(WireCodec codec, uint32_t maxFrame) : codec_(Codec::Create(codec, maxFrame)) {}
+
+    // Codec::Decode: the bytes the request spans, 0 if more are needed, -1 if the stream is malformed.
+    int64_t Next(const char* data, size_t len, CodecRequest& req) {
+        return codec_->Decode(data, len, req, payload_);
+    }
+
+    // Body of the request Next returned last.
+    const std::string& Payload() const { return payload_; }
+
+    // The handler's answer to the request Next returned last, empty for one the codec answers itself.
+    void Dispatch(const CodecRequest& req, std::string& respMsg);
+
+    // Appends the reply to Out(), so replies to pipelined requests leave in one write.
+    void Reply(const CodecRequest& req, const std::string& respMsg) {
+        codec_->Encode(req, req.local ? payload_ : respMsg, out_);
+    }
+
+    // Next, Dispatch and Reply for every complete request at the front of data.
+    // Returns the bytes they spanned, -1 if the stream is malformed.
+    int64_t Serve(const char* data, size_t len);
+
+    std::string& Out() { return out_; }
+
+    // Lets go of buffers a large request grew beyond keepSize.
+    void Trim(size_t keepSize);
+
+private:
+    std::unique_ptr<Codec> codec_;
+    RequestHandler handler_;
+    std::string payload_;
+    std::string respMsg_;
+    std::string out_;
+};
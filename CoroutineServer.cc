@@ -1,9 +1,19 @@
 #include "CoroutineServer.h"
+#include "Lz4.h"
 #include "RequestHandler.h"
+#include <csignal>
 #include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h> 
 #include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 
 AsyncServer::~AsyncServer() {
     StopServer();
@@ -11,103 +21,300 @@ AsyncServer::~AsyncServer() {
 
 void AsyncServer::StopServer() {
     running_ = false;
+    HugePageArena::Stats arenaStats;
+    if(GetArenaStats(arenaStats)) {
+        INFO_LOG("arena chunks[%lu] hugetlb[%lu] in use[%lu] peak[%lu] cached[%lu] refused[%lu]", arenaStats.chunks,
+                arenaStats.hugetlbChunks, arenaStats.inUse, arenaStats.peak, arenaStats.cached, arenaStats.refused);
+    }
+    if(latency_) {
+        const char* names[] = {"kernel to reactor", "reactor to handler", "handler to send"};
+        const LatencyHistogram* legs[] = {&latency_->kernelToReactor, &latency_->reactorToHandler, &latency_->handlerToSend};
+        for(int i = 0; i < 3; ++i) {
+            INFO_LOG("latency %s: count[%lu] p50[%ld ns] p99[%ld ns] p99.9[%ld ns] max[%ld ns]", names[i], legs[i]->Count(),
+                    (long)legs[i]->Percentile(0.5).count(), (long)legs[i]->Percentile(0.99).count(),
+                    (long)legs[i]->Percentile(0.999).count(), (long)legs[i]->Max().count());
+        }
+    }
+    if(journal_) {
+        journal_->Flush();
+    }
+    for(auto &outQueue : mapFd2OutQueue_) {
+        outQueue.second->closing = true;
+    }
+    // every wait under the token returns false now, the resumed coroutines unwind instead of reading again
+    stopToken_.Cancel();
     sel_.ShutDown();
     for(auto &clientSocket : mapFd2Task_) {
+        if(rateLimiter_) {
+            rateLimiter_->Release(clientSocket.first);
+        }
         close(clientSocket.first);
     }
     mapFd2Task_.clear();
-    if(listenSocket_ != INVALID_SOCKET_VALUE) {
-        close(listenSocket_);
-        listenSocket_ = INVALID_SOCKET_VALUE;
+    mapFd2OutQueue_.clear();
+    for(auto &recvBuf : mapFd2RecvBuf_) {
+        _ReleaseRecvBuf(recvBuf.second);
+    }
+    mapFd2RecvBuf_.clear();
+    for(auto buf : recvPool_) {
+        delete[] buf;
+    }
+    recvPool_.clear();
+    for(auto &shmSession : mapFd2ShmSession_) {
+        close(shmSession.first);
+    }
+    mapFd2ShmSession_.clear();
+    // after a hot upgrade the paths belong to the successor
+    for(auto &listener : listeners_) {
+        close(listener.fd);
+        if(AF_UNIX == listener.config.family && !handingOver_) {
+            unlink(listener.config.address.c_str());
+        }
+    }
+    listeners_.clear();
+    if(shmListenSocket_ != INVALID_SOCKET_VALUE) {
+        close(shmListenSocket_);
+        shmListenSocket_ = INVALID_SOCKET_VALUE;
+        if(!handingOver_) {
+            unlink(shmPath_.c_str());
+        }
+    }
+    if(upgradeListenFd_ != INVALID_SOCKET_VALUE) {
+        close(upgradeListenFd_);
+        upgradeListenFd_ = INVALID_SOCKET_VALUE;
+        if(!handingOver_) {
+            unlink(upgradePath_.c_str());
+        }
+    }
+    if(handoffFd_ != INVALID_SOCKET_VALUE) {
+        close(handoffFd_);
+        handoffFd_ = INVALID_SOCKET_VALUE;
     }
 }
 
 Task<bool> AsyncServer::StartServer(uint16_t prrt) {
-    listenSocket_ = socket(AF_INET, SOCK_STREAM, 0);
-    if(-1 == listenSocket_) {
-        ERROR_LOG("create socket failed, errno: %d, error: %s", errno, strerror(errno));
+    // sendfile and splice have no MSG_NOSIGNAL, a peer that went away must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+    if(!AddListener(ListenerConfig{AF_INET, "", prrt})) {
         co_return false;
     }
 
-    int32_t flags = fcntl(listenSocket_, F_GETFL, 0);
-    if(-1 == flags) {
-        ERROR_LOG("fcntl get flags failed, errno: %d, error: %s", errno, strerror(errno));
-        co_return false;
-    }
+    INFO_LOG("Server started on port %d", prrt);
+    co_return true;
+}
 
-    flags |= O_NONBLOCK;
-    if(-1 == fcntl(listenSocket_, F_SETFL, flags)) {
-        ERROR_LOG("fcntl set nonblock failed, errno: %d, error: %s", errno, strerror(errno));
-        co_return false;
+bool AsyncServer::AddListener(const ListenerConfig& config) {
+    int listenFd = CreateListenSocket(config);
+    if(INVALID_SOCKET_VALUE == listenFd) {
+        return false;
     }
+    return _StartListener(listenFd, config);
+}
 
-    int32_t opt = 1;
-    if(-1 == setsockopt(listenSocket_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        ERROR_LOG("setsockopt SO_REUSEADDR failed, errno: %d, error: %s", errno, strerror(errno));
-        co_return false;
+bool AsyncServer::_StartListener(int listenFd, const ListenerConfig& config) {
+    running_ = true;
+    // a child token, so a hot upgrade can stop accepting without stopping the rest
+    sel_.Bind(listenFd, stopToken_.Child());
+    listeners_.push_back(Listener{listenFd, config, {}});
+    listeners_.back().acceptTask = AcceptLoop(listenFd, config.codec);
+    INFO_LOG("listener fd[%d] family[%d] codec[%d] started on [%s]:%hu", listenFd, config.family, config.codec,
+            config.address.c_str(), config.port);
+    return true;
+}
+
+int AsyncServer::ConnectLocal(WireCodec codec) {
+    int fds[2];
+    if(-1 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds)) {
+        ERROR_LOG("socketpair failed, errno: %d, error: %s", errno, strerror(errno));
+        return INVALID_SOCKET_VALUE;
     }
-    
-    if(-1 == setsockopt(listenSocket_, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt))) {
-        ERROR_LOG("setsockopt TCP_NODELAY failed, errno: %d, error: %s", errno, strerror(errno));
-        co_return false;
+    running_ = true;
+    mapFd2RecvBuf_[fds[0]] = RecvBuf();
+    _StartSession(fds[0], codec);
+    INFO_LOG("local client fd[%d] served on fd[%d] codec[%d]", fds[1], fds[0], codec);
+    return fds[1];
+}
+
+void AsyncServer::EnableResponseCache(size_t budget, std::chrono::milliseconds ttl, std::vector<MsgType> types) {
+    respCache_ = std::make_unique<ResponseCache>(budget, ttl, std::move(types));
+}
+
+void AsyncServer::EnableLatencyTrace(bool kernelTimestamps) {
+    latency_ = std::make_unique<LatencyStats>();
+    latency_->kernelTimestamps = kernelTimestamps;
+}
+
+void AsyncServer::EnableRateLimit(const RateLimit& perIp, const RateLimit& perConn, uint32_t maxConnPerIp) {
+    rateLimiter_ = std::make_unique<RateLimiter>(perIp, perConn, maxConnPerIp);
+}
+
+bool AsyncServer::StartShmListener(const std::string& path, uint32_t ringSize) {
+    shmListenSocket_ = CreateListenSocket(ListenerConfig{AF_UNIX, path, 0});
+    if(INVALID_SOCKET_VALUE == shmListenSocket_) {
+        return false;
     }
 
-    struct sockaddr_in serverAddress;
-    memset(&serverAddress, 0, sizeof(serverAddress));
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_addr.s_addr = INADDR_ANY;
-    serverAddress.sin_port = htons(prrt);
+    sel_.Bind(shmListenSocket_, stopToken_);
+    shmPath_     = path;
+    shmRingSize_ = ringSize;
+    running_     = true;
+    shmAcceptTask_ = ShmAcceptLoop();
+    INFO_LOG("Shm listener started on %s, ring size[%u]", path.c_str(), ringSize);
+    return true;
+}
 
-    if(-1 == bind(listenSocket_, (struct sockaddr *)&serverAddress, sizeof(serverAddress))) {
-        ERROR_LOG("bind failed, errno: %d, error: %s", errno, strerror(errno));
-        co_return false;
+bool AsyncServer::EnableJournal(const std::string& path, uint32_t batchRecords, std::chrono::microseconds maxDelay) {
+    if(adopting_) {
+        // the predecessor still appends to it, AdoptLoop opens it once the handover is done
+        deferredJournal_ = JournalConfig{path, batchRecords, maxDelay};
+        INFO_LOG("journal %s opens once the predecessor closed it", path.c_str());
+        return true;
+    }
+    auto journal = std::make_unique<Journal>();
+    uint64_t replayed = 0;
+    if(!journal->Open(path, [&replayed](std::string_view) { ++replayed; })) {
+        return false;
     }
+    journal->SetCommitPolicy(batchRecords, maxDelay);
+    journal_ = std::move(journal);
+    INFO_LOG("journal enabled on %s, %lu messages recovered, batch[%u] delay[%ld us]", path.c_str(), replayed,
+            batchRecords, (long)maxDelay.count());
+    return true;
+}
 
-    if(-1 == listen(listenSocket_, 10)) {   
-        ERROR_LOG("listen failed, errno: %d, error: %s", errno, strerror(errno));
+Task<bool> AsyncServer::_Persist(MsgType type, const std::string& payload) {
+    if(journalHandedOver_) {
         co_return false;
     }
+    if(!journal_) {
+        co_await JournalOpened{this};
+        if(!journal_) {
+            co_return false;
+        }
+    }
+    uint64_t seq = 0;
+    if(MsgType::BATCH == type) {
+        std::vector<std::pair<MsgHead, std::string_view>> subs;
+        if(!RequestHandler::SplitBatch(payload, subs)) {
+            // the handler rejects the batch as a whole, nothing of it gets acknowledged
+            co_return true;
+        }
+        for(auto& sub : subs) {
+            if(MsgType::MSG != sub.first.type) {
+                continue;
+            }
+            seq = journal_->Append(sub.second.data(), sub.second.length());
+            if(0 == seq) {
+                co_return false;
+            }
+        }
+        if(0 == seq) {
+            co_return true;
+        }
+    } else {
+        seq = journal_->Append(payload.data(), payload.length());
+        if(0 == seq) {
+            co_return false;
+        }
+    }
+    // one commit covers every record of the batch
+    co_return co_await JournalCommit{journal_.get(), seq};
+}
 
-    running_ = true;
-    acceptTask_ = std::move(AcceptLoop());
-    INFO_LOG("Server started on port %d", prrt);
-    co_return true;
+bool AsyncServer::GetArenaStats(HugePageArena::Stats& stats) const {
+    if(!arena_) {
+        return false;
+    }
+    stats = arena_->GetStats();
+    return true;
 }
 
 void AsyncServer::RunServer() {
+    if(busyPoll_.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(busyPoll_.cpu, &cpus);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if(0 != err) {
+            WARN_LOG("pin reactor thread to cpu[%d] failed, error: %s", busyPoll_.cpu, strerror(err));
+        } else {
+            INFO_LOG("reactor thread pinned to cpu[%d]", busyPoll_.cpu);
+        }
+    }
+    if(hugePageLimit_ > 0) {
+        arena_ = HugePageArena::EnableLocal(hugePageLimit_);
+    }
+    if(idle_.releaseAfter.count() > 0 || idle_.timeout.count() > 0) {
+        idleSweep_ = IdleSweep();
+    }
+    if(sel_.spinFor.count() > 0) {
+        INFO_LOG("reactor busy polls, back to %ld us select waits after %ld us without events",
+                (long)sel_.idleWait.count(), (long)sel_.spinFor.count());
+    }
+
     while(running_) {
-        sel_.RunOnce(listenSocket_);
-        for(auto itr = mapFd2Task_.begin(); itr != mapFd2Task_.end();) {
-            if(itr->second.Done()) {
-                INFO_LOG("Find task has been done, fd[%d]", itr->first);
-                sel_.CancelFd(itr->first);
-                close(itr->first);
-                itr = mapFd2Task_.erase(itr);
-            } else {
-                ++itr;
+        RunOnce();
+    }
+}
+
+void AsyncServer::RunOnce() {
+    sel_.RunOnce();
+    if(journal_) {
+        journal_->Poll();
+    }
+    for(auto itr = mapFd2Task_.begin(); itr != mapFd2Task_.end();) {
+        if(itr->second.Done()) {
+            INFO_LOG("Find task has been done, fd[%d]", itr->first);
+            _DropSubscriber(itr->first);
+            sel_.CancelFd(itr->first);
+            if(rateLimiter_) {
+                rateLimiter_->Release(itr->first);
             }
+            auto recvBuf = mapFd2RecvBuf_.find(itr->first);
+            if(recvBuf != mapFd2RecvBuf_.end()) {
+                _ReleaseRecvBuf(recvBuf->second);
+                mapFd2RecvBuf_.erase(recvBuf);
+            }
+            close(itr->first);
+            itr = mapFd2Task_.erase(itr);
+        } else {
+            ++itr;
+        }
+    }
+    for(auto itr = mapFd2ShmSession_.begin(); itr != mapFd2ShmSession_.end();) {
+        if(itr->second.session.Done()) {
+            INFO_LOG("Find shm session has been done, fd[%d]", itr->first);
+            sel_.CancelFd(itr->first);
+            sel_.CancelFd(itr->second.channel->serverEventFd);
+            close(itr->first);
+            itr = mapFd2ShmSession_.erase(itr);
+        } else {
+            ++itr;
         }
     }
 }
 
-Task<void> AsyncServer::AcceptLoop() {
-    INFO_LOG("start accept loop coroutine");
+Task<void> AsyncServer::AcceptLoop(int listenFd, WireCodec codec) {
+    INFO_LOG("start accept loop coroutine, listen fd[%d]", listenFd);
     while(running_) {
-        co_await OnReadable{&this->sel_, listenSocket_};
-        if(!running_) {
+        if(!co_await OnReadable{&this->sel_, listenFd} || !running_) {
             INFO_LOG("finish accept looop coroutine");
             co_return;
         }
         while(true) {
-            struct sockaddr_in clientAddress{};
+            struct sockaddr_storage clientAddress{};
             socklen_t cliAddrLen = sizeof(clientAddress);
-            int clientFd = accept4(listenSocket_, (sockaddr*)&clientAddress, &cliAddrLen, SOCK_NONBLOCK);
+            int clientFd = accept4(listenFd, (sockaddr*)&clientAddress, &cliAddrLen, SOCK_NONBLOCK);
             if(clientFd >= 0) {
-                std::string clientIp(INET_ADDRSTRLEN, '0');
-                inet_ntop(AF_INET, &clientAddress.sin_addr, clientIp.data(), clientIp.length());
-                INFO_LOG("accept client ip[%s:%hu] connect.", clientIp.c_str(), ntohs(clientAddress.sin_port));
-                mapFd2RecvBuf_.emplace(clientFd, new char[BUFFER_SIZE]);
-                mapFd2Task_.emplace(clientFd, SessionEcho(clientFd));
+                INFO_LOG("accept client [%s] connect, fd[%d].", _FormatPeer(clientAddress).c_str(), clientFd);
+                if(rateLimiter_ && !rateLimiter_->Admit(clientFd, clientAddress)) {
+                    WARN_LOG("client [%s] over its connection rate limit, rejected", _FormatPeer(clientAddress).c_str());
+                    close(clientFd);
+                    continue;
+                }
+                // storage comes with the first read
+                mapFd2RecvBuf_[clientFd] = RecvBuf();
+                _StartSession(clientFd, codec);
                 continue;
             }
             if(errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -127,126 +334,1362 @@ Task<void> AsyncServer::AcceptLoop() {
     co_return;
 }
 
+void AsyncServer::_StartSession(int clientFd, WireCodec codec) {
+    mapFd2RecvBuf_[clientFd].codec = codec;
+    if(busyPoll_.socketBusyPollUs > 0) {
+        // needs CAP_NET_ADMIN above net.core.busy_read, the reactor spins regardless
+        int busyPollUs = busyPoll_.socketBusyPollUs;
+        if(-1 == setsockopt(clientFd, SOL_SOCKET, SO_BUSY_POLL, &busyPollUs, sizeof(busyPollUs))) {
+            WARN_LOG("setsockopt SO_BUSY_POLL failed, errno: %d, error: %s", errno, strerror(errno));
+        }
+    }
+    if(latency_ && latency_->kernelTimestamps) {
+        // software stamps only, taken when the packet reaches the stack, no NIC support needed
+        int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+        if(-1 == setsockopt(clientFd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags))) {
+            WARN_LOG("setsockopt SO_TIMESTAMPING failed, errno: %d, error: %s", errno, strerror(errno));
+        }
+    }
+    sel_.SetLane(clientFd, LANE_INTERACTIVE);
+    sel_.Bind(clientFd, stopToken_.Child());
+    // MsgHead connections keep their own session for the negotiated extensions and streamed bodies
+    if(CODEC_MSG_HEAD == codec) {
+        mapFd2Task_.emplace(clientFd, SessionEcho(clientFd));
+    } else {
+        mapFd2Task_.emplace(clientFd, SessionCodec(clientFd, codec));
+    }
+}
+
+std::string AsyncServer::_FormatPeer(const struct sockaddr_storage& addr) {
+    char ip[INET6_ADDRSTRLEN]{};
+    if(AF_INET == addr.ss_family) {
+        auto in = (const struct sockaddr_in*)&addr;
+        inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+        return std::string(ip) + ":" + std::to_string(ntohs(in->sin_port));
+    } else if(AF_INET6 == addr.ss_family) {
+        auto in6 = (const struct sockaddr_in6*)&addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+        return "[" + std::string(ip) + "]:" + std::to_string(ntohs(in6->sin6_port));
+    }
+    return "unix";
+}
+
+Task<void> AsyncServer::ShmAcceptLoop() {
+    INFO_LOG("start shm accept loop coroutine");
+    while(running_) {
+        if(!co_await OnReadable{&this->sel_, shmListenSocket_} || !running_) {
+            break;
+        }
+        while(true) {
+            int ctrlFd = accept4(shmListenSocket_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(ctrlFd < 0) {
+                if(errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                    ERROR_LOG("Failed to accept shm client errno: %d, errmsg: %s", errno, strerror(errno));
+                }
+                break;
+            }
+
+            auto channel = std::make_unique<ShmChannel>();
+            if(!channel->Create(shmRingSize_) || !_SendShmHandshake(ctrlFd, *channel)) {
+                close(ctrlFd);
+                continue;
+            }
+            // the mapping stays valid without the memfd, the client holds its own copy
+            close(channel->memFd);
+            channel->memFd = -1;
+
+            INFO_LOG("accept shm client fd[%d]", ctrlFd);
+            // the control socket and the ring doorbell belong to one session, one token cancels both
+            CancelToken token = stopToken_.Child();
+            sel_.Bind(ctrlFd, token);
+            sel_.Bind(channel->serverEventFd, token);
+            auto& state = mapFd2ShmSession_[ctrlFd];
+            state.channel = std::move(channel);
+            state.session = ShmSession(state.channel.get());
+            state.watch   = ShmWatch(ctrlFd, state.channel.get());
+        }
+    }
+
+    INFO_LOG("finish shm accept loop coroutine");
+    co_return;
+}
+
+bool AsyncServer::_SendShmHandshake(int ctrlFd, const ShmChannel& channel) {
+    ShmHandshake hs{SHM_MAGIC, SHM_VERSION, shmRingSize_};
+    int fds[3] = {channel.memFd, channel.serverEventFd, channel.clientEventFd};
+
+    struct iovec iov{&hs, sizeof(hs)};
+    char ctrlBuf[CMSG_SPACE(sizeof(fds))]{};
+    struct msghdr msg{};
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctrlBuf;
+    msg.msg_controllen = sizeof(ctrlBuf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if(sendmsg(ctrlFd, &msg, MSG_NOSIGNAL) != sizeof(hs)) {
+        ERROR_LOG("send shm handshake failed, errno: %d, errmsg: %s", errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+Task<void> AsyncServer::ShmSession(ShmChannel* channel) {
+    auto& reqRing  = channel->reqRing;
+    auto& respRing = channel->respRing;
+    MsgHead head{};
+    std::string readData;
+    while(running_ && !channel->closed) {
+        bool handled = false;
+        while(reqRing.Pop(head, readData)) {
+            handled = true;
+            RequestHandler handler;
+            std::string respMsg;
+            if(_NeedPersist(head.type) && !co_await _Persist(head.type, readData)) {
+                respMsg.assign(sizeof(bool), '\0');
+            } else {
+                handler.HandleRequest(head.type, readData, respMsg);
+            }
+            if(!respRing.Fits(respMsg.length())) {
+                ERROR_LOG("response len[%lu] exceeds shm ring size[%u]", respMsg.length(), respRing.Capacity());
+                respMsg.assign(sizeof(bool), '\0');
+            }
+
+            while(!respRing.Push(head.msgId, head.type, respMsg.data(), respMsg.length())) {
+                // let the client drain what it already has before we sleep on a full ring
+                ShmChannel::Wake(channel->clientEventFd);
+                if(respRing.ArmProducerWait(respMsg.length())) {
+                    bool woken = co_await OnReadable{&sel_, channel->serverEventFd};
+                    ShmChannel::Drain(channel->serverEventFd);
+                    respRing.DisarmProducerWait();
+                    if(!woken || !running_ || channel->closed) {
+                        co_return;
+                    }
+                }
+            }
+        }
+
+        if(handled) {
+            // one wakeup for the whole drained batch
+            if(respRing.ConsumerWaiting() || reqRing.ProducerWaiting()) {
+                ShmChannel::Wake(channel->clientEventFd);
+            }
+            continue;
+        }
+
+        if(reqRing.ArmConsumerWait()) {
+            bool woken = co_await OnReadable{&sel_, channel->serverEventFd};
+            ShmChannel::Drain(channel->serverEventFd);
+            reqRing.DisarmConsumerWait();
+            if(!woken) {
+                break;
+            }
+        }
+    }
+
+    co_return;
+}
+
+Task<void> AsyncServer::ShmWatch(int ctrlFd, ShmChannel* channel) {
+    // nothing is expected on the control socket after the handshake, it only reports the peer going away
+    char buf[64];
+    while(running_) {
+        if(!co_await OnReadable{&sel_, ctrlFd}) {
+            break;
+        }
+        int len = recv(ctrlFd, buf, sizeof(buf), 0);
+        if(len > 0 || (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))) {
+            continue;
+        }
+        INFO_LOG("shm client fd[%d] closed the connection", ctrlFd);
+        break;
+    }
+
+    channel->closed = true;
+    ShmChannel::Wake(channel->serverEventFd);
+    co_return;
+}
+
 Task<void> AsyncServer::SessionEcho(int cliendFd) {
+    // kept across requests, so once they have grown to the connection's usual sizes
+    // serving a request does not allocate
     std::string readData;
+    std::string respMsg;
+    Response response;
+    RequestHandler handler;
+    OutQueue* out = nullptr;    // set once the connection subscribed
+    std::chrono::steady_clock::time_point handled{};    // the traced request just served went to its handler then
     while(true) {
+        // only a request that got its reply out comes back here
+        if(handled != std::chrono::steady_clock::time_point{}) {
+            latency_->handlerToSend.Record(std::chrono::steady_clock::now() - handled);
+            handled = {};
+        }
+        _Trim(readData);
+        _Trim(respMsg);
+        _Trim(response.frame);
         readData.clear();
+        respMsg.clear();
+        response.frame.clear();
+        response.body.Reset();
+        // a hot upgrade moves the connection on between requests
+        if(handingOver_ && _HandOff(cliendFd)) {
+            break;
+        }
         INFO_LOG("client fd[%d] co_await ReadData", cliendFd)
         auto req = co_await ReadData(cliendFd, readData);
         INFO_LOG("co_await read data len[%lu] readData[%s]", req.reqDataLen, readData.c_str());
-        if(req.reqDataLen <= 0) {
+        if(req.reqDataLen < 0) {
             break;
         }
+        sel_.SetLane(cliendFd, _LaneOf(req.type));
+
+        // a client out of tokens sleeps off its debt before it gets to read again
+        if(rateLimiter_ && !co_await SleepFor{&sel_, cliendFd, rateLimiter_->Charge(cliendFd, 1, sizeof(MsgHead) + req.reqDataLen)}) {
+            break;
+        }
+
+        // a pipelining client never blocks in recv, it pays per request and yields once its lane is spent
+        if(sel_.Charge(cliendFd) && !co_await Reschedule{&sel_, cliendFd}) {
+            break;
+        }
+
+        OutQueueGuard writeGuard(&sel_, cliendFd, out);
+        if(out && !co_await OutQueueLock{&sel_, cliendFd, out}) {
+            break;
+        }
+
+        if(latency_) {
+            handled = std::chrono::steady_clock::now();
+            latency_->reactorToHandler.Record(handled - req.arrival);
+            if(req.inKernel.count() >= 0) {
+                latency_->kernelToReactor.Record(req.inKernel);
+            }
+        }
+
+        if(_Expired(req)) {
+            // the client stopped waiting, answer without running anything for it
+            WARN_LOG("client fd[%d] msgId[%u] type[%d] deadline exceeded, skipped", cliendFd, req.reqId, req.type);
+            respMsg.assign(sizeof(bool), '\0');
+            respMsg += "deadline exceeded";
+            _MakeResponse(req.reqId, req.type, respMsg, response.frame);
+            if(!co_await SendData(cliendFd, response)) {
+                break;
+            }
+            continue;
+        }
+
+        if(MsgType::HELLO == req.type) {
+            _Negotiate(cliendFd, req, readData, response);
+            if(!co_await SendData(cliendFd, response)) {
+                break;
+            }
+            continue;
+        }
+
+        if(_IsPubSub(req.type)) {
+            _HandlePubSub(cliendFd, req.type, readData, respMsg);
+            if(!out && mapFd2OutQueue_.count(cliendFd)) {
+                // the queue is new and its drain idle, the lock is free for the reply
+                out = mapFd2OutQueue_[cliendFd].get();
+                writeGuard.out = out;
+                co_await OutQueueLock{&sel_, cliendFd, out};
+            }
+            _MakeResponse(req.reqId, req.type, respMsg, response.frame);
+            if(!co_await SendData(cliendFd, response)) {
+                break;
+            }
+            continue;
+        }
 
-        RequestHandler handler;
-        std::string respMsg;
-        handler.HandleRequest(req.type, readData, respMsg);
-        std::string response;
-        _MakeResponse(req.reqId, req.type, respMsg, response);
+        if(MsgType::UPLOAD == req.type) {
+            if(!co_await SessionStream(cliendFd, req)) {
+                break;
+            }
+            continue;
+        }
 
-        INFO_LOG("client fd[%d] co_await SendData, response len[%u]", cliendFd, (uint32_t)response.length())
-        co_await SendData(cliendFd, response);
+        if(MsgType::LIST == req.type) {
+            auto frames = handler.HandleList(readData);
+            if(!co_await SendStream(cliendFd, req.reqId, frames)) {
+                break;
+            }
+            continue;
+        }
+
+        bool cacheable = respCache_ && respCache_->Cacheable(req.type);
+        if(cacheable) {
+            ResponseCache::Frame cached;
+            if(respCache_->Lookup(req.type, readData, cached)) {
+                if(!co_await SendCached(cliendFd, req.reqId, *cached)) {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        if(_NeedPersist(req.type) && !co_await _Persist(req.type, readData)) {
+            // never acknowledge a message that did not make it to disk
+            respMsg.assign(sizeof(bool), '\0');
+        } else {
+            handler.HandleRequest(req.type, readData, respMsg, response.body);
+        }
+        // a compressed frame is only valid for clients with CAP_LZ4, keep it out of the shared cache
+        bool compressed = ResponseBody::NONE == response.body.kind
+            && _MakeCompressedResponse(mapFd2RecvBuf_[cliendFd], req.reqId, req.type, respMsg, response.frame);
+        if(!compressed) {
+            _MakeResponse(req.reqId, req.type, respMsg, response.frame, response.body.len);
+        }
+        if(cacheable && !compressed && ResponseBody::NONE == response.body.kind) {
+            respCache_->Insert(req.type, readData, response.frame);
+        }
+
+        INFO_LOG("client fd[%d] co_await SendData, response len[%u], body len[%lu]", cliendFd,
+                (uint32_t)response.frame.length(), response.body.len)
+        if(!co_await SendData(cliendFd, response)) {
+            break;
+        }
     }
 
     co_return;
 }
 
-Task<ReqData> AsyncServer::ReadData(int clientFd, std::string& readData) {
-    auto itr = mapFd2RecvBuf_.find(clientFd);
-    if(itr == mapFd2RecvBuf_.end()) {
-        co_return ReqData{0, -1, MsgType::UNKNOWN};
-    }
+Task<void> AsyncServer::SessionCodec(int clientFd, WireCodec codec) {
+    auto& recvBuf = mapFd2RecvBuf_[clientFd];
+    uint32_t parsed = 0;
+    Connection conn(codec, BUFFER_SIZE);
+    std::string respMsg;
+    while(true) {
+        bool yield = false;
+        uint32_t served = 0;
+        uint64_t servedBytes = 0;
+        while(parsed < recvBuf.usedBuf && !yield) {
+            CodecRequest req;
+            int64_t len = conn.Next(recvBuf.recvBuf + parsed, recvBuf.usedBuf - parsed, req);
+            if(len < 0) {
+                ERROR_LOG("client fd[%d] malformed request, drop connection", clientFd);
+                co_return;
+            }
+            if(0 == len) {
+                break;
+            }
+            parsed += len;
+            ++served;
+            servedBytes += len;
+            sel_.SetLane(clientFd, _LaneOf(req.type));
+
+            // the journal write sits between decode and dispatch, it is the step that waits on the reactor
+            if(!req.local && _NeedPersist(req.type) && !co_await _Persist(req.type, conn.Payload())) {
+                respMsg.assign(sizeof(bool), '\0');
+            } else {
+                conn.Dispatch(req, respMsg);
+            }
+            conn.Reply(req, respMsg);
+            yield = sel_.Charge(clientFd);
+        }
 
-    int readLen = sizeof(MsgHead);
-    INFO_LOG("request header len[%d]", readLen);
-    while(readLen > 0) {
-        int len = recv(clientFd, itr->second.recvBuf + itr->second.usedBuf, readLen, 0);
+        auto& out = conn.Out();
+        if(!out.empty()) {
+            if(!co_await SendAll(&sel_, clientFd, out.data(), out.length())) {
+                co_return;
+            }
+            out.clear();
+        }
+        if(rateLimiter_ && served > 0 && !co_await SleepFor{&sel_, clientFd, rateLimiter_->Charge(clientFd, served, servedBytes)}) {
+            co_return;
+        }
+        // a deep pipeline is served in slices, with the rest of its lane in between
+        if(yield) {
+            if(!co_await Reschedule{&sel_, clientFd}) {
+                co_return;
+            }
+            continue;
+        }
+
+        // keep the partial request at the front, its offsets are relative to its start
+        if(parsed > 0) {
+            memmove(recvBuf.recvBuf, recvBuf.recvBuf + parsed, recvBuf.usedBuf - parsed);
+            recvBuf.usedBuf -= parsed;
+            parsed = 0;
+        }
+        if(handingOver_ && _HandOff(clientFd)) {
+            co_return;
+        }
+        if(!recvBuf.recvBuf) {
+            _AcquireRecvBuf(recvBuf);
+        }
+        if(recvBuf.usedBuf == recvBuf.capacity && !_ReserveRecvBuf(recvBuf, recvBuf.capacity + 1)) {
+            ERROR_LOG("client fd[%d] request larger than max buffer size: %u", clientFd, BUFFER_SIZE);
+            co_return;
+        }
+
+        int len = recv(clientFd, recvBuf.recvBuf + recvBuf.usedBuf, recvBuf.capacity - recvBuf.usedBuf, 0);
         if(len < 0) {
             if(EINTR == errno) {
-                INFO_LOG("Failed to read data, errno: %d, errmsg: %s, ignore", errno, strerror(errno));
                 continue;
             } else if(EAGAIN == errno || EWOULDBLOCK == errno) {
-                INFO_LOG("Failed to read data, errno: %d, errmsg: %s, wait to read data", errno, strerror(errno));
-                co_await OnReadable{&sel_, clientFd};
+                conn.Trim(SESSION_KEEP_SIZE);
+                _Trim(respMsg);
+                recvBuf.waitingSince = std::chrono::steady_clock::now();
+                bool readable = co_await OnReadable{&sel_, clientFd};
+                recvBuf.waitingSince = {};
+                if(!readable) {
+                    co_return;
+                }
                 continue;
-            } 
-            
+            }
             INFO_LOG("Failed to read data, errno: %d, errmsg: %s, connection closed", errno, strerror(errno));
-            co_return ReqData{0, -1, MsgType::UNKNOWN};;
+            co_return;
         } else if(0 == len) {
             INFO_LOG("Peer closed the connection");
-            co_return ReqData{0, 0, MsgType::UNKNOWN};
+            co_return;
+        }
+        recvBuf.usedBuf += len;
+    }
+}
+
+Task<ReqData> AsyncServer::ReadData(int clientFd, std::string& readData) {
+    auto itr = mapFd2RecvBuf_.find(clientFd);
+    if(itr == mapFd2RecvBuf_.end()) {
+        co_return ReqData{0, -1, MsgType::UNKNOWN};
+    }
+
+    auto& recvBuf = itr->second;
+    bool checksum = recvBuf.caps & CAP_CRC32C;
+    uint32_t headLen = sizeof(MsgHead) + (checksum ? sizeof(uint32_t) : 0);
+    INFO_LOG("request header len[%u]", headLen);
+    // a connection handed over mid-header comes with the bytes it sent so far
+    if(!co_await _RecvExact(clientFd, recvBuf, headLen - recvBuf.usedBuf, false)) {
+        co_return ReqData{0, -1, MsgType::UNKNOWN};
+    }
+    INFO_LOG("request used buf len[%u]", recvBuf.usedBuf);
+    // deadlines count from here, the time a pipelined header spent in the socket is only in inKernel
+    auto arrival = std::chrono::steady_clock::now();
+    auto inKernel = recvBuf.inKernel;
+    recvBuf.inKernel = std::chrono::nanoseconds(-1);
+
+    recvBuf.pHead = reinterpret_cast<PMsgHead>(recvBuf.recvBuf);
+    if(checksum) {
+        memcpy(&recvBuf.expectCrc, recvBuf.recvBuf + sizeof(MsgHead), sizeof(uint32_t));
+        recvBuf.crc = Crc32c(0, recvBuf.recvBuf, sizeof(MsgHead));
+    }
+
+    // the flag is not a MsgType value, strip it before anyone looks at the type
+    uint32_t rawType;
+    memcpy(&rawType, &recvBuf.pHead->type, sizeof(rawType));
+    recvBuf.pHead->type = (MsgType)(rawType & ~MSG_EXT_FLAG);
+
+    MsgHeadExt ext{};
+    if(rawType & MSG_EXT_FLAG) {
+        if(!(recvBuf.caps & (CAP_LZ4 | CAP_DEADLINE)) || MsgType::UPLOAD == recvBuf.pHead->type) {
+            ERROR_LOG("client fd[%d] sent a header extension it did not negotiate, drop connection", clientFd);
+            co_return ReqData{0, -1, MsgType::UNKNOWN};
+        }
+        if(!co_await _RecvExact(clientFd, recvBuf, MSG_EXT_V1_LEN, checksum)) {
+            co_return ReqData{0, -1, MsgType::UNKNOWN};
         }
+        memcpy(&ext, recvBuf.recvBuf + headLen, MSG_EXT_V1_LEN);
+        bool v2 = 2 == ext.version && sizeof(MsgHeadExt) == ext.extLen;
+        if(!v2 && (1 != ext.version || MSG_EXT_V1_LEN != ext.extLen)) {
+            ERROR_LOG("client fd[%d] header extension version[%u] len[%u] not supported, drop connection",
+                    clientFd, ext.version, ext.extLen);
+            co_return ReqData{0, -1, MsgType::UNKNOWN};
+        }
+        if(v2) {
+            if(!co_await _RecvExact(clientFd, recvBuf, sizeof(MsgHeadExt) - MSG_EXT_V1_LEN, checksum)) {
+                co_return ReqData{0, -1, MsgType::UNKNOWN};
+            }
+            memcpy(&ext, recvBuf.recvBuf + headLen, sizeof(ext));
+        }
+        uint8_t allowed = ((recvBuf.caps & CAP_LZ4) ? EXT_LZ4 : 0) | ((v2 && (recvBuf.caps & CAP_DEADLINE)) ? EXT_DEADLINE : 0);
+        if(ext.flags & ~allowed) {
+            ERROR_LOG("client fd[%d] header extension flags[%x] not negotiated, drop connection", clientFd, ext.flags);
+            co_return ReqData{0, -1, MsgType::UNKNOWN};
+        }
+        headLen += ext.extLen;
+    }
 
-        itr->second.usedBuf += len;
-        readLen             -= len;
+    if(MsgType::UPLOAD == recvBuf.pHead->type) {
+        ReqData req{recvBuf.pHead->msgId, (int32_t)recvBuf.pHead->dataLen, MsgType::UPLOAD, {}, arrival, inKernel};
+        recvBuf.pHead = nullptr;
+        recvBuf.usedBuf = 0;
+        co_return req;
     }
-    INFO_LOG("request used buf len[%u]", itr->second.usedBuf);
 
-    itr->second.pHead = reinterpret_cast<PMsgHead>(itr->second.recvBuf);
-    readLen = itr->second.pHead->dataLen;
-    INFO_LOG("request datalen[%d]", readLen);
-    while(readLen > 0) {
-        int len = recv(clientFd, itr->second.recvBuf + itr->second.usedBuf, readLen, 0);
-        if(len < 0) {
+    bool compressed = ext.flags & EXT_LZ4;
+    uint32_t dataLen = compressed ? ext.rawLen : recvBuf.pHead->dataLen;
+    if(recvBuf.pHead->dataLen + headLen > BUFFER_SIZE || dataLen + sizeof(MsgHead) > BUFFER_SIZE) {
+        ERROR_LOG("request data len: %u larger than max buffer size: %u",
+                dataLen + (uint32_t)sizeof(MsgHead), BUFFER_SIZE);
+        co_return ReqData{0, -1, MsgType::UNKNOWN};
+    }
+
+    if(!_ReserveRecvBuf(recvBuf, headLen + recvBuf.pHead->dataLen)) {
+        co_return ReqData{0, -1, MsgType::UNKNOWN};
+    }
+
+    INFO_LOG("request datalen[%u] compressed[%d]", recvBuf.pHead->dataLen, compressed);
+    if(!co_await _RecvExact(clientFd, recvBuf, recvBuf.pHead->dataLen, checksum)) {
+        co_return ReqData{0, -1, MsgType::UNKNOWN};
+    }
+
+    if(checksum && recvBuf.crc != recvBuf.expectCrc) {
+        ERROR_LOG("client fd[%d] msgId[%u] crc mismatch, expect[%08x] actual[%08x], drop connection",
+                clientFd, recvBuf.pHead->msgId, recvBuf.expectCrc, recvBuf.crc);
+        co_return ReqData{0, -1, MsgType::UNKNOWN};
+    }
+
+    uint32_t msgId = recvBuf.pHead->msgId;
+    MsgType type = recvBuf.pHead->type;
+    const char* body = recvBuf.recvBuf + headLen;
+    readData.resize(dataLen);
+    if(compressed) {
+        // inflate straight out of the receive buffer, the compressed bytes are never copied
+        if(Lz4Decompress(body, recvBuf.pHead->dataLen, readData.data(), dataLen) != (int64_t)dataLen) {
+            ERROR_LOG("client fd[%d] msgId[%u] malformed lz4 body, drop connection", clientFd, msgId);
+            co_return ReqData{0, -1, MsgType::UNKNOWN};
+        }
+    } else {
+        memcpy(readData.data(), body, dataLen);
+    }
+    recvBuf.pHead = nullptr;
+    recvBuf.usedBuf = 0;
+
+    ReqData req{msgId, (int32_t)dataLen, type, {}, arrival, inKernel};
+    if((ext.flags & EXT_DEADLINE) && ext.timeoutUs > 0) {
+        req.deadline = arrival + std::chrono::microseconds(ext.timeoutUs);
+    }
+    co_return req;
+}
+
+void AsyncServer::_AcquireRecvBuf(RecvBuf& recvBuf) {
+    if(arena_) {
+        if(auto buf = (char*)arena_->Allocate(ARENA_RECV_SIZE)) {
+            recvBuf.recvBuf  = buf;
+            recvBuf.capacity = ARENA_RECV_SIZE;
+            return;
+        }
+    }
+    if(!recvPool_.empty()) {
+        recvBuf.recvBuf = recvPool_.back();
+        recvPool_.pop_back();
+    } else {
+        recvBuf.recvBuf = new char[BUFFER_SIZE];
+    }
+    recvBuf.capacity = BUFFER_SIZE;
+}
+
+void AsyncServer::_ReleaseRecvBuf(RecvBuf& recvBuf) {
+    if(!recvBuf.recvBuf) {
+        return;
+    }
+    if(arena_ && arena_->Owns(recvBuf.recvBuf)) {
+        arena_->Release(recvBuf.recvBuf, recvBuf.capacity);
+    } else if(recvPool_.size() < RECV_POOL_SIZE) {
+        recvPool_.push_back(recvBuf.recvBuf);
+    } else {
+        delete[] recvBuf.recvBuf;
+    }
+    recvBuf.recvBuf  = nullptr;
+    recvBuf.capacity = 0;
+}
+
+Task<void> AsyncServer::IdleSweep() {
+    auto period = std::chrono::milliseconds::max();
+    for(auto limit : {idle_.releaseAfter, idle_.timeout}) {
+        if(limit.count() > 0) {
+            period = std::min(period, limit);
+        }
+    }
+    period = std::max(IDLE_SWEEP_MIN, period / 2);
+    INFO_LOG("idle sweep every %ld ms, release after %ld ms, disconnect after %ld ms",
+            (long)period.count(), (long)idle_.releaseAfter.count(), (long)idle_.timeout.count());
+
+    // fd -1 has no token, StopServer ends the loop through running_
+    while(running_ && co_await SleepFor{&sel_, -1, period}) {
+        if(!running_) {
+            break;
+        }
+        auto now = std::chrono::steady_clock::now();
+        uint32_t released = 0, dropped = 0;
+        for(auto& [fd, recvBuf] : mapFd2RecvBuf_) {
+            if(std::chrono::steady_clock::time_point{} == recvBuf.waitingSince) {
+                continue;
+            }
+            auto idleFor = now - recvBuf.waitingSince;
+            if(idle_.timeout.count() > 0 && idleFor >= idle_.timeout && !mapFd2OutQueue_.count(fd) && !sel_.Cancelled(fd)) {
+                // the session unwinds on its next resume and is reaped like any closed one
+                sel_.Cancel(fd);
+                ++dropped;
+                continue;
+            }
+            // only between frames, a partial frame still needs its bytes
+            if(idle_.releaseAfter.count() > 0 && idleFor >= idle_.releaseAfter && recvBuf.recvBuf && 0 == recvBuf.usedBuf) {
+                _ReleaseRecvBuf(recvBuf);
+                ++released;
+            }
+        }
+        if(released > 0) {
+            // freed session strings sit in malloc's free lists otherwise, and still count as resident
+            malloc_trim(0);
+        }
+        if(released > 0 || dropped > 0) {
+            INFO_LOG("idle sweep released %u receive buffers, disconnected %u connections", released, dropped);
+        }
+    }
+    co_return;
+}
+
+bool AsyncServer::EnableHotUpgrade(const std::string& path, bool handoffConnections, std::chrono::milliseconds drainTimeout) {
+    upgradeListenFd_ = CreateListenSocket(ListenerConfig{AF_UNIX, path, 0});
+    if(INVALID_SOCKET_VALUE == upgradeListenFd_) {
+        return false;
+    }
+    // whoever connects gets the listeners, keep it to this user
+    if(-1 == chmod(path.c_str(), 0600)) {
+        WARN_LOG("chmod upgrade socket %s failed, errno: %d, error: %s", path.c_str(), errno, strerror(errno));
+    }
+
+    sel_.Bind(upgradeListenFd_, stopToken_.Child());
+    upgradePath_        = path;
+    handoffConnections_ = handoffConnections;
+    drainTimeout_       = drainTimeout;
+    running_            = true;
+    upgradeTask_ = UpgradeLoop();
+    INFO_LOG("hot upgrade enabled on %s, hand off connections[%d] drain timeout[%ld ms]", path.c_str(),
+            handoffConnections, (long)drainTimeout.count());
+    return true;
+}
+
+bool AsyncServer::TakeOver(const std::string& path) {
+    if(journal_) {
+        ERROR_LOG("take over before EnableJournal, the journal still belongs to the predecessor");
+        return false;
+    }
+    struct sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if(path.empty() || path.length() >= sizeof(addr.sun_path)) {
+        ERROR_LOG("invalid unix socket path[%s]", path.c_str());
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.length());
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(-1 == sock) {
+        ERROR_LOG("create socket failed, errno: %d, error: %s", errno, strerror(errno));
+        return false;
+    }
+    if(-1 == connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+        INFO_LOG("nothing to take over at %s, errno: %d, error: %s", path.c_str(), errno, strerror(errno));
+        close(sock);
+        return false;
+    }
+    if(!SetHandoffTimeout(sock)) {
+        close(sock);
+        return false;
+    }
+
+    std::vector<std::pair<int, ListenerConfig>> vecListeners;
+    HandoffRecord record;
+    bool done = false;
+    while(!done && RecvHandoff(sock, record)) {
+        if(HANDOFF_LISTENER == record.kind && record.fd >= 0) {
+            vecListeners.emplace_back(record.fd, ListenerConfig{record.family, record.address, record.port, record.codec});
+            continue;
+        }
+        if(record.fd >= 0) {
+            close(record.fd);
+        }
+        done = HANDOFF_LISTENERS_DONE == record.kind;
+        if(!done) {
+            ERROR_LOG("unexpected handoff record kind[%u] before the listeners were done", record.kind);
+            break;
+        }
+    }
+    if(!done) {
+        // the predecessor keeps its listeners until we confirm
+        for(auto& listener : vecListeners) {
+            close(listener.first);
+        }
+        close(sock);
+        return false;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    for(auto& [listenFd, config] : vecListeners) {
+        _StartListener(listenFd, config);
+    }
+    // the predecessor stops accepting once it hears back
+    record = HandoffRecord();
+    record.kind = HANDOFF_LISTENERS_DONE;
+    if(!SendHandoff(sock, record)) {
+        WARN_LOG("predecessor gone right after the listeners, it keeps its connections");
+    }
+
+    handoffFd_ = sock;
+    adopting_  = true;
+    sel_.Bind(handoffFd_, stopToken_.Child());
+    adoptTask_ = AdoptLoop();
+    INFO_LOG("took over %lu listeners from %s", vecListeners.size(), path.c_str());
+    return true;
+}
+
+Task<void> AsyncServer::UpgradeLoop() {
+    INFO_LOG("start upgrade loop coroutine");
+    while(running_) {
+        if(!co_await OnReadable{&sel_, upgradeListenFd_} || !running_) {
+            break;
+        }
+        int sock = accept4(upgradeListenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if(sock < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                ERROR_LOG("Failed to accept successor errno: %d, errmsg: %s", errno, strerror(errno));
+            }
+            continue;
+        }
+
+        // nothing changes here until the successor confirms it accepts on the listeners
+        bool sent = SetHandoffTimeout(sock);
+        for(auto& listener : listeners_) {
+            HandoffRecord record;
+            record.kind    = HANDOFF_LISTENER;
+            record.fd      = listener.fd;
+            record.family  = listener.config.family;
+            record.address = listener.config.address;
+            record.port    = listener.config.port;
+            record.codec   = listener.config.codec;
+            sent = sent && SendHandoff(sock, record);
+        }
+        HandoffRecord record;
+        record.kind = HANDOFF_LISTENERS_DONE;
+        sent = sent && SendHandoff(sock, record) && RecvHandoff(sock, record);
+        if(record.fd >= 0) {
+            close(record.fd);
+        }
+        if(!sent || HANDOFF_LISTENERS_DONE != record.kind) {
+            ERROR_LOG("successor did not take the listeners over, keep serving");
+            close(sock);
+            continue;
+        }
+
+        for(auto& listener : listeners_) {
+            sel_.Cancel(listener.fd);
+        }
+        handoffFd_   = sock;
+        handingOver_ = true;
+        INFO_LOG("successor accepts on %lu listeners, draining %lu connections", listeners_.size(), mapFd2Task_.size());
+
+        auto deadline = std::chrono::steady_clock::now() + drainTimeout_;
+        uint32_t left = 0;
+        bool lost = false;
+        while(true) {
+            left = 0;
+            for(auto& [fd, task] : mapFd2Task_) {
+                if(task.Done() || sel_.Cancelled(fd) || mapFd2OutQueue_.count(fd)) {
+                    continue;
+                }
+                // parked on the client, it would only notice the handover with its next request
+                auto recvBuf = mapFd2RecvBuf_.find(fd);
+                if(recvBuf != mapFd2RecvBuf_.end() && std::chrono::steady_clock::time_point{} != recvBuf->second.waitingSince
+                    && _HandOff(fd)) {
+                    sel_.Cancel(fd);
+                    continue;
+                }
+                ++left;
+            }
+            // a failed send closes the socket, a successor that exits shows up as EOF
+            char probe;
+            lost = INVALID_SOCKET_VALUE == handoffFd_ || 0 == recv(handoffFd_, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+            if(lost || 0 == left || std::chrono::steady_clock::now() >= deadline) {
+                break;
+            }
+            co_await SleepFor{&sel_, -1, HANDOFF_POLL};
+            if(!running_) {
+                co_return;
+            }
+        }
+
+        if(lost) {
+            ERROR_LOG("successor lost during the handover, %u connections went over, accepting again", handoffCount_);
+            if(handoffFd_ != INVALID_SOCKET_VALUE) {
+                close(handoffFd_);
+                handoffFd_ = INVALID_SOCKET_VALUE;
+            }
+            handingOver_ = false;
+            for(auto& listener : listeners_) {
+                // drops the stale resume of the old accept loop before its frame goes
+                sel_.CancelFd(listener.fd);
+                sel_.Bind(listener.fd, stopToken_.Child());
+                listener.acceptTask = AcceptLoop(listener.fd, listener.config.codec);
+            }
+            continue;
+        }
+
+        // every journaled request got its commit, from here on the file is the successor's
+        if(journal_) {
+            journal_->Flush();
+        }
+        journalHandedOver_ = true;
+        record = HandoffRecord();
+        record.kind = HANDOFF_END;
+        SendHandoff(handoffFd_, record);
+        close(handoffFd_);
+        handoffFd_ = INVALID_SOCKET_VALUE;
+        INFO_LOG("handover done, %u connections went over, %u closed with the process", handoffCount_, left);
+        running_ = false;
+        break;
+    }
+
+    INFO_LOG("finish upgrade loop coroutine");
+    co_return;
+}
+
+bool AsyncServer::_HandOff(int fd) {
+    if(!handoffConnections_ || INVALID_SOCKET_VALUE == handoffFd_ || mapFd2OutQueue_.count(fd) || sel_.Cancelled(fd)) {
+        return false;
+    }
+    auto itr = mapFd2RecvBuf_.find(fd);
+    if(itr == mapFd2RecvBuf_.end()) {
+        return false;
+    }
+    // a frame with its header in keeps state the successor could not rebuild, it finishes here
+    auto& recvBuf = itr->second;
+    if(recvBuf.pHead || recvBuf.usedBuf > HANDOFF_MAX_PENDING) {
+        return false;
+    }
+
+    HandoffRecord record;
+    record.kind  = HANDOFF_CONNECTION;
+    record.fd    = fd;
+    record.codec = recvBuf.codec;
+    record.caps  = recvBuf.caps;
+    record.pending.assign(recvBuf.recvBuf ? recvBuf.recvBuf : "", recvBuf.usedBuf);
+    if(!SendHandoff(handoffFd_, record)) {
+        close(handoffFd_);
+        handoffFd_ = INVALID_SOCKET_VALUE;
+        return false;
+    }
+    ++handoffCount_;
+    INFO_LOG("client fd[%d] handed over with %u pending bytes", fd, recvBuf.usedBuf);
+    return true;
+}
+
+Task<void> AsyncServer::AdoptLoop() {
+    INFO_LOG("start adopt loop coroutine");
+    uint32_t adopted = 0;
+    HandoffRecord record;
+    while(co_await OnReadable{&sel_, handoffFd_}) {
+        if(!RecvHandoff(handoffFd_, record)) {
+            WARN_LOG("predecessor went away before it finished the handover");
+            break;
+        }
+        if(HANDOFF_END == record.kind) {
+            break;
+        }
+        if(HANDOFF_CONNECTION == record.kind && record.fd >= 0) {
+            _AdoptConnection(record);
+            ++adopted;
+        } else if(record.fd >= 0) {
+            close(record.fd);
+        }
+    }
+    sel_.CancelFd(handoffFd_);
+    close(handoffFd_);
+    handoffFd_ = INVALID_SOCKET_VALUE;
+    adopting_  = false;
+    INFO_LOG("handover finished, %u connections adopted", adopted);
+
+    if(running_ && deferredJournal_) {
+        if(EnableJournal(deferredJournal_->path, deferredJournal_->batchRecords, deferredJournal_->maxDelay)) {
+            deferredJournal_.reset();
+        } else {
+            // still configured, so MSG requests are refused instead of acknowledged without it
+            ERROR_LOG("open journal %s after the handover failed", deferredJournal_->path.c_str());
+        }
+    }
+    for(auto h : journalWaiters_) {
+        sel_.Ready(-1, h);
+    }
+    journalWaiters_.clear();
+    co_return;
+}
+
+void AsyncServer::_AdoptConnection(HandoffRecord& record) {
+    int clientFd = record.fd;
+    struct sockaddr_storage peer{};
+    socklen_t peerLen = sizeof(peer);
+    getpeername(clientFd, (struct sockaddr*)&peer, &peerLen);
+    if(rateLimiter_ && !rateLimiter_->Admit(clientFd, peer)) {
+        WARN_LOG("client [%s] over its connection rate limit, handed over connection closed", _FormatPeer(peer).c_str());
+        close(clientFd);
+        return;
+    }
+    INFO_LOG("adopt client [%s] fd[%d] codec[%d] caps[%x] with %lu pending bytes", _FormatPeer(peer).c_str(), clientFd,
+            record.codec, record.caps, record.pending.length());
+
+    // O_NONBLOCK belongs to the open file, the socket arrives as the predecessor's accept left it
+    auto& recvBuf = mapFd2RecvBuf_[clientFd] = RecvBuf();
+    recvBuf.caps = record.caps;
+    if(!record.pending.empty()) {
+        _AcquireRecvBuf(recvBuf);
+        _ReserveRecvBuf(recvBuf, record.pending.length());
+        memcpy(recvBuf.recvBuf, record.pending.data(), record.pending.length());
+        recvBuf.usedBuf = record.pending.length();
+    }
+    _StartSession(clientFd, record.codec);
+}
+
+bool AsyncServer::_ReserveRecvBuf(RecvBuf& recvBuf, uint32_t len) {
+    if(len <= recvBuf.capacity) {
+        return true;
+    }
+    if(len > BUFFER_SIZE) {
+        return false;
+    }
+    // a connection that outgrew its arena buffer gets a full size one, the pages it never touches cost nothing
+    char* buf = nullptr;
+    if(!recvPool_.empty()) {
+        buf = recvPool_.back();
+        recvPool_.pop_back();
+    } else {
+        buf = new char[BUFFER_SIZE];
+    }
+    memcpy(buf, recvBuf.recvBuf, recvBuf.usedBuf);
+    RecvBuf old;
+    old.recvBuf  = recvBuf.recvBuf;
+    old.capacity = recvBuf.capacity;
+    _ReleaseRecvBuf(old);
+    recvBuf.recvBuf  = buf;
+    recvBuf.capacity = BUFFER_SIZE;
+    if(recvBuf.pHead) {
+        recvBuf.pHead = reinterpret_cast<PMsgHead>(buf);
+    }
+    return true;
+}
+
+int AsyncServer::_RecvStamped(int clientFd, RecvBuf& recvBuf, uint32_t len) {
+    struct iovec iov{recvBuf.recvBuf + recvBuf.usedBuf, len};
+    char ctrlBuf[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct msghdr msg{};
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctrlBuf;
+    msg.msg_controllen = sizeof(ctrlBuf);
+    int ret = recvmsg(clientFd, &msg, 0);
+    if(ret <= 0) {
+        return ret;
+    }
+    // the stamps are CLOCK_REALTIME, ts[0] is the software one
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(SOL_SOCKET == cmsg->cmsg_level && SCM_TIMESTAMPING == cmsg->cmsg_type) {
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+            recvBuf.inKernel = std::chrono::seconds(now.tv_sec - stamps.ts[0].tv_sec)
+                + std::chrono::nanoseconds(now.tv_nsec - stamps.ts[0].tv_nsec);
+        }
+    }
+    return ret;
+}
+
+Task<bool> AsyncServer::_RecvExact(int clientFd, RecvBuf& recvBuf, uint32_t len, bool checksum) {
+    while(len > 0) {
+        if(!recvBuf.recvBuf) {
+            _AcquireRecvBuf(recvBuf);
+        }
+        // the first bytes of a frame carry the rx timestamp of the whole request
+        int ret = latency_ && latency_->kernelTimestamps && 0 == recvBuf.usedBuf
+            ? _RecvStamped(clientFd, recvBuf, len) : recv(clientFd, recvBuf.recvBuf + recvBuf.usedBuf, len, 0);
+        if(ret < 0) {
             if(EINTR == errno) {
                 INFO_LOG("Failed to read data, errno: %d, errmsg: %s, ignore", errno, strerror(errno));
                 continue;
             } else if(EAGAIN == errno || EWOULDBLOCK == errno) {
                 INFO_LOG("Failed to read data, errno: %d, errmsg: %s, wait to read data", errno, strerror(errno));
-                co_await OnReadable{&sel_, clientFd};
+                recvBuf.waitingSince = std::chrono::steady_clock::now();
+                bool readable = co_await OnReadable{&sel_, clientFd};
+                recvBuf.waitingSince = {};
+                if(!readable) {
+                    co_return false;
+                }
                 continue;
-            } 
-            
+            }
+
             INFO_LOG("Failed to read data, errno: %d, errmsg: %s, connection closed", errno, strerror(errno));
-            co_return ReqData{0, -1, MsgType::UNKNOWN};;
-        } else if(0 == len) {
+            co_return false;
+        } else if(0 == ret) {
             INFO_LOG("Peer closed the connection");
-            co_return ReqData{0, 0, MsgType::UNKNOWN};;
+            co_return false;
         }
 
-        itr->second.usedBuf += len;
-        readLen             -= len;
+        // checksum the bytes while they are still hot in cache, instead of another pass over the body
+        if(checksum) {
+            recvBuf.crc = Crc32c(recvBuf.crc, recvBuf.recvBuf + recvBuf.usedBuf, ret);
+        }
+        recvBuf.usedBuf += ret;
+        len             -= ret;
     }
+    co_return true;
+}
 
-    readLen = itr->second.pHead->dataLen;
-    uint32_t msgId = itr->second.pHead->msgId;
-    MsgType type = itr->second.pHead->type;
-    readData.resize(readLen);
-    memcpy(readData.data(), itr->second.recvBuf + sizeof(MsgHead), readLen);
-    itr->second.pHead = nullptr;
-    itr->second.usedBuf = 0;
-    co_return ReqData{msgId, readLen, type};
+Task<bool> AsyncServer::SessionStream(int clientFd, const ReqData& req) {
+    auto& recvBuf = mapFd2RecvBuf_[clientFd];
+    uint32_t chunkSize = std::min(STREAM_CHUNK_SIZE, recvBuf.capacity);
+    BodyReader body(&sel_, clientFd, recvBuf.recvBuf, chunkSize, req.reqDataLen);
+    if(recvBuf.caps & CAP_CRC32C) {
+        body.VerifyCrc(recvBuf.crc, recvBuf.expectCrc);
+    }
+    ChunkWriter writer(&sel_, clientFd, req.reqId);
+    INFO_LOG("client fd[%d] stream request msgId[%u] body len[%d]", clientFd, req.reqId, req.reqDataLen);
+
+    RequestHandler handler;
+    co_await handler.HandleUpload(body, writer);
+    if(!writer.Ended() && !co_await writer.End(std::string(sizeof(bool), '\0'))) {
+        co_return false;
+    }
+    co_return co_await body.Skip();
 }
 
-Task<void> AsyncServer::SendData(int clientFd, const std::string& data) {
-    int writeLen = 0;
-    int dataLen = data.length();
-    while(writeLen < dataLen) {
-        int len = send(clientFd, data.data() + writeLen, dataLen - writeLen, 0);
-        if(len > 0) {
-            INFO_LOG("Succeed to write data len[%d]", len);
-            writeLen += len;
+void AsyncServer::_Negotiate(int clientFd, const ReqData& req, const std::string& reqMsg, Response& response) {
+    uint32_t wanted = 0;
+    std::string respMsg(sizeof(bool) + sizeof(uint32_t), '\0');
+    if(reqMsg.length() >= sizeof(wanted)) {
+        memcpy(&wanted, reqMsg.data(), sizeof(wanted));
+        uint32_t granted = wanted & SUPPORTED_CAPS;
+        mapFd2RecvBuf_[clientFd].caps = granted;
+        *(bool *)respMsg.data() = true;
+        memcpy(respMsg.data() + sizeof(bool), &granted, sizeof(granted));
+        INFO_LOG("client fd[%d] wants caps[%x], granted[%x], crc32c hardware[%d]", clientFd, wanted, granted, Crc32cHardware());
+    }
+    _MakeResponse(req.reqId, req.type, respMsg, response.frame);
+}
+
+void AsyncServer::_HandlePubSub(int clientFd, MsgType type, const std::string& reqMsg, std::string& respMsg) {
+    respMsg.assign(sizeof(bool), '\0');
+    if(MsgType::SUBSCRIBE == type) {
+        pubSub_.Subscribe(clientFd, reqMsg);
+        auto& out = mapFd2OutQueue_[clientFd];
+        if(!out) {
+            out = std::make_unique<OutQueue>();
+            out->drain = SubscriberDrain(clientFd, out.get());
+        }
+        *(bool *)respMsg.data() = true;
+        INFO_LOG("client fd[%d] subscribed to [%s], %lu topics", clientFd, reqMsg.c_str(), pubSub_.Topics());
+        return;
+    }
+    if(MsgType::UNSUBSCRIBE == type) {
+        *(bool *)respMsg.data() = pubSub_.Unsubscribe(clientFd, reqMsg);
+        return;
+    }
+
+    uint32_t topicLen = 0;
+    if(reqMsg.length() < sizeof(topicLen)) {
+        return;
+    }
+    memcpy(&topicLen, reqMsg.data(), sizeof(topicLen));
+    if(topicLen > reqMsg.length() - sizeof(topicLen)) {
+        return;
+    }
+    // encoded once, every subscriber queues the same buffer
+    std::string frame;
+    _MakeResponse(0, MsgType::MESSAGE, reqMsg, frame);
+    auto shared = std::make_shared<const std::string>(std::move(frame));
+    uint32_t queued = 0;
+    if(auto subscribers = pubSub_.Subscribers(reqMsg.substr(sizeof(topicLen), topicLen))) {
+        for(int fd : *subscribers) {
+            queued += _Deliver(fd, shared);
+        }
+    }
+    *(bool *)respMsg.data() = true;
+    respMsg.append((const char*)&queued, sizeof(queued));
+}
+
+bool AsyncServer::_Deliver(int fd, const std::shared_ptr<const std::string>& frame) {
+    auto itr = mapFd2OutQueue_.find(fd);
+    if(itr == mapFd2OutQueue_.end() || sel_.Cancelled(fd)) {
+        return false;
+    }
+    OutQueue& out = *itr->second;
+    if(out.queuedBytes + frame->length() > outQueueLimit_) {
+        if(SLOW_DISCONNECT == slowPolicy_) {
+            WARN_LOG("subscriber fd[%d] has %lu bytes queued, disconnect", fd, out.queuedBytes);
+            sel_.Cancel(fd);
+        } else {
+            ++out.dropped;
+            INFO_LOG("subscriber fd[%d] has %lu bytes queued, dropped %lu messages", fd, out.queuedBytes, out.dropped);
+        }
+        return false;
+    }
+    out.frames.push_back(frame);
+    out.queuedBytes += frame->length();
+    if(out.idle) {
+        sel_.Ready(fd, std::exchange(out.idle, {}));
+    }
+    return true;
+}
+
+Task<void> AsyncServer::SubscriberDrain(int clientFd, OutQueue* out) {
+    std::vector<std::shared_ptr<const std::string>> sending;
+    struct iovec iov[OUT_QUEUE_IOV];
+    while(co_await OutQueueIdle{&sel_, clientFd, out}) {
+        OutQueueGuard writeGuard(&sel_, clientFd, out);
+        if(!co_await OutQueueLock{&sel_, clientFd, out}) {
+            break;
+        }
+        // the frames stay referenced until sendmsg is done with them
+        int iovCnt = 0;
+        while(!out->frames.empty() && iovCnt < OUT_QUEUE_IOV) {
+            sending.push_back(std::move(out->frames.front()));
+            out->frames.pop_front();
+            out->queuedBytes -= sending.back()->length();
+            iov[iovCnt].iov_base = (void*)sending.back()->data();
+            iov[iovCnt].iov_len  = sending.back()->length();
+            ++iovCnt;
+        }
+        bool sent = co_await SendAllV(&sel_, clientFd, iov, iovCnt);
+        sending.clear();
+        if(!sent) {
+            break;
+        }
+    }
+    co_return;
+}
+
+void AsyncServer::_DropSubscriber(int clientFd) {
+    pubSub_.RemoveFd(clientFd);
+    auto itr = mapFd2OutQueue_.find(clientFd);
+    if(itr == mapFd2OutQueue_.end()) {
+        return;
+    }
+    auto out = std::move(itr->second);
+    mapFd2OutQueue_.erase(itr);
+    // the drain's frame goes before the queue it points into
+    out->closing = true;
+    out->drain = Task<void>();
+}
+
+Task<bool> AsyncServer::SendStream(int clientFd, uint32_t msgId, AsyncGenerator<std::string>& frames) {
+    ChunkWriter writer(&sel_, clientFd, msgId);
+    uint32_t count = 0;
+    while(co_await frames.Next()) {
+        if(!co_await writer.Write(frames.Value())) {
+            co_return false;
+        }
+        ++count;
+    }
+    INFO_LOG("client fd[%d] msgId[%u] stream finished, frames[%u]", clientFd, msgId, count);
+    co_return co_await writer.End(std::string(sizeof(bool), '\1'));
+}
+
+Task<bool> SendAll(Selector* sel, int fd, const char* data, size_t len) {
+    size_t writeLen = 0;
+    while(writeLen < len) {
+        int ret = send(fd, data + writeLen, len - writeLen, MSG_NOSIGNAL);
+        if(ret > 0) {
+            INFO_LOG("Succeed to write data len[%d]", ret);
+            writeLen += ret;
             continue;
         }
         if(errno == EAGAIN || errno == EWOULDBLOCK) {
             INFO_LOG("Failed to write data errno: %d, errmsg: %s, ignore", errno, strerror(errno));
-            co_await OnWritable{&sel_, clientFd};
+            if(!co_await OnWritable{sel, fd}) {
+                co_return false;
+            }
             continue;
         }
-        break;
+        if(errno == EINTR) {
+            continue;
+        }
+        co_return false;
     }
-    co_return;
+    co_return true;
+}
+
+Task<bool> SendAllV(Selector* sel, int fd, struct iovec* iov, int iovCnt) {
+    while(iovCnt > 0) {
+        struct msghdr msg{};
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = iovCnt;
+        ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(ret < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                if(!co_await OnWritable{sel, fd}) {
+                    co_return false;
+                }
+                continue;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            co_return false;
+        }
+
+        while(iovCnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            ++iov;
+            --iovCnt;
+        }
+        if(iovCnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    co_return true;
+}
+
+Task<bool> BodyReader::Next(std::string_view& chunk) {
+    while(remaining_ > 0 && !failed_) {
+        int len = recv(fd_, buf_, std::min(bufLen_, remaining_), 0);
+        if(len > 0) {
+            remaining_ -= len;
+            chunk = std::string_view(buf_, len);
+            if(verify_) {
+                crc_ = Crc32c(crc_, buf_, len);
+                if(0 == remaining_ && crc_ != expected_) {
+                    ERROR_LOG("stream body crc mismatch, expect[%08x] actual[%08x]", expected_, crc_);
+                    failed_ = true;
+                }
+            }
+            co_return true;
+        }
+        if(len < 0 && EINTR == errno) {
+            continue;
+        }
+        if(len < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            if(co_await OnReadable{sel_, fd_}) {
+                continue;
+            }
+            INFO_LOG("stream body cancelled, remaining[%u]", remaining_);
+            failed_ = true;
+            break;
+        }
+        INFO_LOG("stream body broken, remaining[%u], errno: %d, errmsg: %s", remaining_, errno, strerror(errno));
+        failed_ = true;
+    }
+    co_return false;
+}
+
+Task<bool> BodyReader::Skip() {
+    std::string_view chunk;
+    while(co_await Next(chunk)) {}
+    co_return !failed_;
+}
+
+Task<bool> ChunkWriter::Write(const std::string& data) {
+    co_return co_await _SendFrame(MsgType::STREAM_CHUNK, data);
+}
+
+Task<bool> ChunkWriter::End(const std::string& data) {
+    ended_ = true;
+    co_return co_await _SendFrame(MsgType::STREAM_END, data);
+}
+
+Task<bool> ChunkWriter::_SendFrame(MsgType type, const std::string& data) {
+    std::string frame(sizeof(MsgHead) + data.length(), '\0');
+    auto head = (PMsgHead)frame.data();
+    head->msgId   = msgId_;
+    head->type    = type;
+    head->dataLen = data.length();
+    memcpy(frame.data() + sizeof(MsgHead), data.data(), data.length());
+    co_return co_await SendAll(sel_, fd_, frame.data(), frame.length());
 }
 
-void AsyncServer::_MakeResponse(uint32_t msgId, MsgType type, const std::string& respMsg, std::string& response) {
-    uint32_t totalLen = sizeof(MsgHead) + respMsg.length();
-    response.resize(totalLen);
+Task<bool> AsyncServer::SendData(int clientFd, const Response& response) {
+    if(!co_await SendAll(&sel_, clientFd, response.frame.data(), response.frame.length())) {
+        co_return false;
+    }
+
+    // the body goes from the page cache or pipe straight to the socket
+    const ResponseBody& body = response.body;
+    size_t bodySent = 0;
+    while(bodySent < body.len) {
+        ssize_t len = -1;
+        if(ResponseBody::FILE_REGION == body.kind) {
+            off_t offset = body.offset + bodySent;
+            len = sendfile(clientFd, body.fd, &offset, body.len - bodySent);
+        } else if(ResponseBody::PIPE == body.kind) {
+            len = splice(body.fd, nullptr, clientFd, nullptr, body.len - bodySent, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            break;
+        }
 
+        if(len > 0) {
+            INFO_LOG("Succeed to send body len[%ld]", (long)len);
+            bodySent += len;
+            continue;
+        }
+        if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if(!co_await OnWritable{&sel_, clientFd}) {
+                co_return false;
+            }
+            continue;
+        }
+        if(len < 0 && errno == EINTR) {
+            continue;
+        }
+        // the frame header promised body.len bytes, a short body leaves the stream unusable
+        ERROR_LOG("Failed to send body, sent[%lu] of [%lu], errno: %d, errmsg: %s", bodySent, body.len, errno, strerror(errno));
+        co_return false;
+    }
+    co_return bodySent == body.len;
+}
+
+Task<bool> AsyncServer::SendCached(int clientFd, uint32_t msgId, const std::string& frame) {
+    static_assert(offsetof(MsgHead, msgId) == 0, "msgId must lead the frame");
+    struct iovec iov[2];
+    iov[0].iov_base = &msgId;
+    iov[0].iov_len  = sizeof(msgId);
+    iov[1].iov_base = const_cast<char*>(frame.data()) + sizeof(msgId);
+    iov[1].iov_len  = frame.length() - sizeof(msgId);
+    co_return co_await SendAllV(&sel_, clientFd, iov, 2);
+}
+
+void AsyncServer::_MakeResponse(uint32_t msgId, MsgType type, const std::string& respMsg, std::string& response, uint32_t bodyLen) {
+    MsgHeadCodec::EncodeFrame(msgId, type, respMsg, bodyLen, response);
+}
+
+bool AsyncServer::_MakeCompressedResponse(RecvBuf& recvBuf, uint32_t msgId, MsgType type, const std::string& respMsg, std::string& response) {
+    if(!(recvBuf.caps & CAP_LZ4) || respMsg.length() < COMPRESS_MIN_SIZE) {
+        return false;
+    }
+    if(recvBuf.compressSkip > 0) {
+        --recvBuf.compressSkip;
+        return false;
+    }
+
+    // compress straight into the outgoing frame, it is sized for the worst case and trimmed after
+    uint32_t headLen = sizeof(MsgHead) + MSG_EXT_V1_LEN;
+    response.resize(headLen + Lz4CompressBound(respMsg.length()));
+    size_t bodyLen = Lz4Compress(respMsg.data(), respMsg.length(), response.data() + headLen, response.length() - headLen);
+    if(0 == bodyLen || bodyLen > respMsg.length() - respMsg.length() / 8) {
+        recvBuf.compressBackoff = std::min(COMPRESS_MAX_BACKOFF, std::max(1u, recvBuf.compressBackoff * 2));
+        recvBuf.compressSkip    = recvBuf.compressBackoff;
+        INFO_LOG("msgId[%u] reply len[%lu] compressed to [%lu], skip next %u replies",
+                msgId, respMsg.length(), bodyLen, recvBuf.compressSkip);
+        response.clear();
+        return false;
+    }
+    recvBuf.compressBackoff = 0;
+    response.resize(headLen + bodyLen);
+
+    uint32_t rawType = type | MSG_EXT_FLAG;
     auto head = (PMsgHead)response.data();
     head->msgId   = msgId;
-    head->type    = type;
-    head->dataLen = respMsg.length();
+    memcpy(&head->type, &rawType, sizeof(rawType));
+    head->dataLen = bodyLen;
 
-    memcpy(response.data() + sizeof(MsgHead), respMsg.data(), respMsg.length());
+    // replies never carry a deadline, version 1 keeps them readable for every CAP_LZ4 client
+    MsgHeadExt ext{1, EXT_LZ4, MSG_EXT_V1_LEN, (uint32_t)respMsg.length(), 0};
+    memcpy(response.data() + sizeof(MsgHead), &ext, MSG_EXT_V1_LEN);
+    INFO_LOG("msgId[%u] reply len[%lu] compressed to [%lu]", msgId, respMsg.length(), bodyLen);
+    return true;
 }
\ No newline at end of file
@@ -1,16 +1,38 @@
+#pragma once
+
+#include "CancelToken.h"
+#include "Codec.h"
+#include "ConnectionEngine.h"
+#include "Crc32c.h"
+#include "FramePool.h"
+#include "Handoff.h"
+#include "HugePageArena.h"
+#include "Journal.h"
+#include "LatencyHistogram.h"
 #include "Logger.h"
 #include "MsgType.h"
+#include "PubSub.h"
+#include "RateLimiter.h"
+#include "Response.h"
+#include "ResponseCache.h"
+#include "RingQueue.h"
+#include "ShmTransport.h"
+#include <algorithm>
 #include <coroutine>
+#include <deque>
 #include <functional>
 #include <exception>
 #include <utility>
 #include <thread>
 #include <chrono>
+#include <memory>
+#include <optional>
+#include <string_view>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <sys/select.h>
 
-const int INVALID_SOCKET_VALUE = -1;
 template <class T>
 struct promise_result {
     T value_;
@@ -37,6 +59,14 @@ public:
     struct promise_type : promise_result<T> {
         std::coroutine_handle<> continuation_{};
 
+        static void* operator new(size_t size) {
+            return FramePool::Allocate(size);
+        }
+
+        static void operator delete(void* ptr, size_t size) {
+            FramePool::Release(ptr, size);
+        }
+
         Task get_return_object() {
             INFO_LOG("Task get_return_object.");
             return Task(std::coroutine_handle<promise_type>::from_promise(*this));
@@ -147,16 +177,180 @@ public:
         if(_handle.promise().eptr_) {
             std::rethrow_exception(_handle.promise().eptr_);
         }
-        return _handle.promise().value_;
+        if constexpr (!std::is_void_v<T>) {
+            return _handle.promise().value_;
+        }
     }
 
 private:
     std::coroutine_handle<promise_type> _handle;
 };
 
+// Lazily started coroutine that produces a sequence of values with co_yield and may
+// co_await in between. The consumer pulls with `while(co_await gen.Next())`, so the
+// producer never runs ahead of what the consumer has taken.
+template <typename T>
+class AsyncGenerator {
+public:
+    struct promise_type {
+        std::optional<T> value_;
+        std::coroutine_handle<> consumer_{};
+        std::exception_ptr eptr_;
+
+        static void* operator new(size_t size) {
+            return FramePool::Allocate(size);
+        }
+
+        static void operator delete(void* ptr, size_t size) {
+            FramePool::Release(ptr, size);
+        }
+
+        AsyncGenerator get_return_object() {
+            INFO_LOG("AsyncGenerator get_return_object.");
+            return AsyncGenerator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        // hands control straight back to whoever is awaiting Next()
+        struct YieldAwaiter {
+            bool await_ready() noexcept {
+                return false;
+            }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                if(auto cont = h.promise().consumer_) {
+                    return cont;
+                }
+                return std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+
+        YieldAwaiter yield_value(T value) {
+            value_ = std::move(value);
+            return {};
+        }
+
+        YieldAwaiter final_suspend() noexcept {
+            INFO_LOG("AsyncGenerator final_suspend.");
+            value_.reset();
+            return {};
+        }
+
+        void return_void() noexcept {}
+
+        void unhandled_exception() {
+            INFO_LOG("AsyncGenerator unhandled_exception.");
+            eptr_ = std::current_exception();
+        }
+    };
+
+    struct NextAwaiter {
+        std::coroutine_handle<promise_type> handle_;
+
+        bool await_ready() const noexcept {
+            return !handle_ || handle_.done();
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) noexcept {
+            handle_.promise().consumer_ = consumer;
+            return handle_;
+        }
+
+        bool await_resume() {
+            if(!handle_) {
+                return false;
+            }
+            if(handle_.promise().eptr_) {
+                std::rethrow_exception(std::exchange(handle_.promise().eptr_, {}));
+            }
+            return !handle_.done();
+        }
+    };
+
+    AsyncGenerator() noexcept = default;
+
+    explicit AsyncGenerator(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+    ~AsyncGenerator() {
+        if(_handle) {
+            _handle.destroy();
+            _handle = {};
+        }
+    }
+
+    AsyncGenerator(const AsyncGenerator&) = delete;
+    AsyncGenerator& operator=(const AsyncGenerator&) = delete;
+
+    AsyncGenerator(AsyncGenerator&& other) noexcept : _handle(std::exchange(other._handle, {})) {}
+
+    AsyncGenerator& operator=(AsyncGenerator&& other) noexcept {
+        if(this != &other) {
+            if(_handle) {
+                _handle.destroy();
+            }
+            _handle = std::exchange(other._handle, {});
+        }
+        return *this;
+    }
+
+    // Resumes the producer until its next co_yield; true when a value is available.
+    NextAwaiter Next() {
+        return NextAwaiter{_handle};
+    }
+
+    T& Value() {
+        return *_handle.promise().value_;
+    }
+
+private:
+    std::coroutine_handle<promise_type> _handle;
+};
+
+// Scheduling classes, lower lanes go first in every tick.
+enum Lane : uint8_t {
+    LANE_CONTROL     = 0,   // listeners, shm wakeups, anything without a connection lane
+    LANE_INTERACTIVE = 1,   // small latency sensitive requests
+    LANE_BULK        = 2,   // large or throughput bound traffic
+    LANE_NUM         = 3
+};
+
+// Wait lists stay in their maps while the fd is open, emptied rather than erased once woken,
+// so their capacity is reused and a connection going back and forth between waiting and
+// running does not touch the heap. CancelFd drops them.
 struct Selector {
     std::unordered_map<int, std::vector<std::coroutine_handle<>>> mapFd2ReadHandle;
     std::unordered_map<int, std::vector<std::coroutine_handle<>>> mapFd2WriteHandle;
+    std::unordered_map<int, Lane> mapFd2Lane;
+    std::unordered_map<int, CancelToken> mapFd2Token;
+
+    // Ready handles wait here until their lane has budget left in a tick, so a lane
+    // with a backlog can not hold the others back beyond its share. Resuming a handle
+    // and serving a request each cost one unit of the lane's budget.
+    RingQueue<std::pair<int, std::coroutine_handle<>>> readyQueue[LANE_NUM];
+    uint32_t laneBudget[LANE_NUM] = {1024, 64, 16};
+    uint32_t laneUsed[LANE_NUM] = {};
+
+    // Coroutines sleeping until when, a min-heap on when. The fd is the one the sleeper
+    // belongs to, for its lane and so that cancelling or closing the fd reaches it.
+    struct Timer {
+        std::chrono::steady_clock::time_point when;
+        int fd;
+        std::coroutine_handle<> h;
+    };
+    std::vector<Timer> timers;
+
+    // Longest select wait with nothing ready. With busy polling on, select gets a zero timeout
+    // for as long as events keep coming within spinFor, and only waits again after a quiet spell.
+    std::chrono::microseconds idleWait{10000};
+    std::chrono::microseconds spinFor{0};           // 0 keeps busy polling off
+    std::chrono::steady_clock::time_point lastEvent{};
+
+    static bool _Later(const Timer& a, const Timer& b) {
+        return a.when > b.when;
+    }
 
     void WaitRead(int fd, std::coroutine_handle<> h) {
         mapFd2ReadHandle[fd].push_back(h);
@@ -166,13 +360,92 @@ struct Selector {
         mapFd2WriteHandle[fd].push_back(h);
     }
 
+    void WaitUntil(int fd, std::chrono::steady_clock::time_point when, std::coroutine_handle<> h) {
+        timers.push_back(Timer{when, fd, h});
+        std::push_heap(timers.begin(), timers.end(), _Later);
+    }
+
+    void SetLane(int fd, Lane lane) {
+        mapFd2Lane[fd] = lane;
+    }
+
+    Lane LaneOf(int fd) const {
+        auto itr = mapFd2Lane.find(fd);
+        return itr == mapFd2Lane.end() ? LANE_CONTROL : itr->second;
+    }
+
+    // Once token is cancelled the coroutines waiting on fd are woken, and every wait on fd
+    // returns false right away instead of suspending, so whole Task chains unwind.
+    void Bind(int fd, CancelToken token) {
+        token.OnCancel([this, fd] { Wake(fd); });
+        mapFd2Token[fd] = std::move(token);
+    }
+
+    // Cancels fd's own token, the coroutines working on fd unwind as if the server stopped.
+    void Cancel(int fd) {
+        auto itr = mapFd2Token.find(fd);
+        if(itr != mapFd2Token.end()) {
+            CancelToken token = itr->second;
+            token.Cancel();
+        }
+    }
+
+    bool Cancelled(int fd) const {
+        auto itr = mapFd2Token.find(fd);
+        return itr != mapFd2Token.end() && itr->second.Cancelled();
+    }
+
+    // Moves everything waiting on fd to the ready queue, whatever the fd's state.
+    void Wake(int fd) {
+        for(auto map : {&mapFd2ReadHandle, &mapFd2WriteHandle}) {
+            auto itr = map->find(fd);
+            if(itr == map->end()) {
+                continue;
+            }
+            for(auto h : itr->second) {
+                Ready(fd, h);
+            }
+            itr->second.clear();
+        }
+        for(auto& timer : timers) {
+            if(timer.fd == fd) {
+                Ready(fd, timer.h);
+            }
+        }
+        _EraseTimers(fd);
+    }
+
+    void _EraseTimers(int fd) {
+        if(std::erase_if(timers, [fd](const Timer& timer) { return timer.fd == fd; }) > 0) {
+            std::make_heap(timers.begin(), timers.end(), _Later);
+        }
+    }
+
+    // Queues h behind the ready work of fd's lane.
+    void Ready(int fd, std::coroutine_handle<> h) {
+        readyQueue[LaneOf(fd)].emplace_back(fd, h);
+    }
+
     void CancelFd(int fd) {
         mapFd2ReadHandle.erase(fd);
         mapFd2WriteHandle.erase(fd);
+        mapFd2Lane.erase(fd);
+        mapFd2Token.erase(fd);
+        _EraseTimers(fd);
+        // the coroutines waiting on fd may be destroyed right after this
+        for(auto& queue : readyQueue) {
+            queue.EraseIf([fd](const auto& ready) { return ready.first == fd; });
+        }
     }
 
     void ShutDown() {
         std::vector<std::coroutine_handle<>> vecResumes;
+        for(auto& queue : readyQueue) {
+            for(size_t i = 0; i < queue.size(); ++i) {
+                vecResumes.push_back(queue[i].second);
+            }
+            queue.clear();
+        }
         for(auto &pr : mapFd2ReadHandle) {
             auto vec = std::move(pr.second);
             vecResumes.insert(vecResumes.end(), vec.begin(), vec.end());
@@ -181,8 +454,12 @@ struct Selector {
             auto vec = std::move(pr.second);
             vecResumes.insert(vecResumes.end(), vec.begin(), vec.end());
         }
+        for(auto& timer : timers) {
+            vecResumes.push_back(timer.h);
+        }
         mapFd2ReadHandle.clear();
         mapFd2WriteHandle.clear();
+        timers.clear();
 
         for(auto h : vecResumes) {
             if(h && !h.done()) {
@@ -191,6 +468,21 @@ struct Selector {
         }
     }
 
+    // Charges one unit to fd's lane, true once the lane is over budget for this tick.
+    bool Charge(int fd) {
+        Lane lane = LaneOf(fd);
+        return ++laneUsed[lane] > laneBudget[lane];
+    }
+
+    bool HasReady() const {
+        for(auto& queue : readyQueue) {
+            if(!queue.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     void RunOnce(int fd = -1) {
         fd_set readFd, writeFd;
         FD_ZERO(&readFd);
@@ -203,78 +495,123 @@ struct Selector {
         }
 
         for(auto& pr : mapFd2ReadHandle) {
-            FD_SET(pr.first, &readFd);
-            maxFd = std::max(maxFd, pr.first);
+            if(!pr.second.empty()) {
+                FD_SET(pr.first, &readFd);
+                maxFd = std::max(maxFd, pr.first);
+            }
         }
         for(auto& pr : mapFd2WriteHandle) {
-            FD_SET(pr.first, &writeFd);
-            maxFd = std::max(maxFd, pr.first);
+            if(!pr.second.empty()) {
+                FD_SET(pr.first, &writeFd);
+                maxFd = std::max(maxFd, pr.first);
+            }
         }
 
-        if(maxFd < 0) {
+        bool backlog = HasReady();
+        if(maxFd < 0 && !backlog && timers.empty()) {
             WARN_LOG("no fd needs to select!");
             return;
         }
 
+        // leftover ready work from the last tick only polls for more, a due timer cuts the wait short
+        bool spinning = spinFor.count() > 0 && std::chrono::steady_clock::now() - lastEvent < spinFor;
+        auto waitUs = (backlog || spinning) ? std::chrono::microseconds(0) : idleWait;
+        if(!timers.empty()) {
+            auto untilTimer = std::chrono::duration_cast<std::chrono::microseconds>(timers.front().when - std::chrono::steady_clock::now());
+            waitUs = std::clamp(untilTimer, std::chrono::microseconds(0), waitUs);
+        }
         struct timeval timeout;
         timeout.tv_sec = 0;
-        timeout.tv_usec = 10000;
+        timeout.tv_usec = waitUs.count();
         int ret = select(maxFd + 1, &readFd, &writeFd, nullptr, &timeout);
         if(ret < 0) {
             WARN_LOG("selct return error, errno: %d, errmsg: %s", errno, strerror(errno));
             return;
         }
 
-        std::vector<std::coroutine_handle<>> vecResumes;
-        if(fd >= 0 && FD_ISSET(fd, &readFd)) {
-            auto itr = mapFd2ReadHandle.find(fd);
-            if(itr != mapFd2ReadHandle.end()) {
-                auto vec = std::move(itr->second);
-                mapFd2ReadHandle.erase(itr);
-                vecResumes.insert(vecResumes.end(), vec.begin(), vec.end());
+        for(auto itr = mapFd2ReadHandle.begin(); ret > 0 && itr != mapFd2ReadHandle.end(); ++itr) {
+            if(!itr->second.empty() && FD_ISSET(itr->first, &readFd)) {
+                for(auto h : itr->second) {
+                    Ready(itr->first, h);
+                }
+                itr->second.clear();
             }
         }
-
-        for(auto itr = mapFd2ReadHandle.begin(); itr != mapFd2ReadHandle.end();) {
-            if(FD_ISSET(itr->first, &readFd)) {
-                auto vec = std::move(itr->second);
-                itr = mapFd2ReadHandle.erase(itr);
-                vecResumes.insert(vecResumes.end(), vec.begin(), vec.end());
-            } else {
-                ++itr;
+        for(auto itr = mapFd2WriteHandle.begin(); ret > 0 && itr != mapFd2WriteHandle.end(); ++itr) {
+            if(!itr->second.empty() && FD_ISSET(itr->first, &writeFd)) {
+                for(auto h : itr->second) {
+                    Ready(itr->first, h);
+                }
+                itr->second.clear();
             }
         }
-        for(auto itr = mapFd2WriteHandle.begin(); itr != mapFd2WriteHandle.end();) {
-            if(FD_ISSET(itr->first, &writeFd)) {
-                auto vec = std::move(itr->second);
-                itr = mapFd2WriteHandle.erase(itr);
-                vecResumes.insert(vecResumes.end(), vec.begin(), vec.end());
-            } else {
-                ++itr;
-            }
+
+        auto now = std::chrono::steady_clock::now();
+        if(ret > 0 || backlog || (!timers.empty() && timers.front().when <= now)) {
+            lastEvent = now;
+        }
+        while(!timers.empty() && timers.front().when <= now) {
+            std::pop_heap(timers.begin(), timers.end(), _Later);
+            Ready(timers.back().fd, timers.back().h);
+            timers.pop_back();
         }
 
-        for(auto h : vecResumes) {
-            if(h && !h.done()) {
-                h.resume();
+        for(int lane = 0; lane < LANE_NUM; ++lane) {
+            laneUsed[lane] = 0;
+        }
+        for(int lane = 0; lane < LANE_NUM; ++lane) {
+            auto& queue = readyQueue[lane];
+            while(!queue.empty() && laneUsed[lane] < laneBudget[lane]) {
+                auto h = queue.front().second;
+                queue.pop_front();
+                ++laneUsed[lane];
+                if(h && !h.done()) {
+                    h.resume();
+                }
             }
         }
     }
 };
 
+// Gives up the rest of the tick: the coroutine goes behind the ready work of fd's lane,
+// which runs again once the next tick refills the budget.
+struct Reschedule {
+    Selector* sel;
+    int fd;
+    bool await_ready() const noexcept { return sel->Cancelled(fd); }
+    void await_suspend(std::coroutine_handle<> h) {
+        sel->Ready(fd, h);
+    }
+    bool await_resume() const noexcept { return !sel->Cancelled(fd); }
+};
+
+// Suspends for delay without blocking the reactor. False if fd's token got cancelled meanwhile.
+struct SleepFor {
+    Selector* sel;
+    int fd;
+    std::chrono::microseconds delay;
+    bool await_ready() const noexcept { return sel->Cancelled(fd) || delay.count() <= 0; }
+    void await_suspend(std::coroutine_handle<> h) {
+        sel->WaitUntil(fd, std::chrono::steady_clock::now() + delay, h);
+    }
+    bool await_resume() const noexcept { return !sel->Cancelled(fd); }
+};
+
+// Waits for fd to become readable. False if fd's token got cancelled, the caller should unwind.
 struct OnReadable {
     Selector* sel;
     int fd;
     bool await_ready() const noexcept { 
         INFO_LOG("OnReadable await_ready.");
-        return false; 
+        return sel->Cancelled(fd);
     }
     void await_suspend(std::coroutine_handle<> h) {
         INFO_LOG("OnReadable await_suspend.");
         sel->WaitRead(fd, h);
     }
-    void await_resume() const noexcept {
+    bool await_resume() const noexcept {
         INFO_LOG("OnReadable await_resume.");
+        return !sel->Cancelled(fd);
     }
 };
 
@@ -283,56 +620,459 @@ struct OnWritable {
     int fd;
     bool await_ready() const noexcept { 
         INFO_LOG("OnWritable await_ready.");
-        return false; 
+        return sel->Cancelled(fd);
     }
     void await_suspend(std::coroutine_handle<> h) {
         INFO_LOG("OnWritable await_suspend.");
         sel->WaitWrite(fd, h);
     }
-    void await_resume() const noexcept {
+    bool await_resume() const noexcept {
         INFO_LOG("OnWriteable await_resume.");
+        return !sel->Cancelled(fd);
     }
 };
 
+// Writes all of data, waiting for writability on EAGAIN. False means the connection is broken;
+// a closed peer is reported as an error instead of raising SIGPIPE.
+Task<bool> SendAll(Selector* sel, int fd, const char* data, size_t len);
+
+// Same for a gather list; iov is consumed as it is sent.
+Task<bool> SendAllV(Selector* sel, int fd, struct iovec* iov, int iovCnt);
+
+// Hands a request body to its handler chunk by chunk, straight from the socket,
+// so the body never has to fit in memory at once.
+class BodyReader {
+public:
+    BodyReader(Selector* sel, int fd, char* buf, uint32_t bufLen, uint32_t bodyLen)
+        : sel_(sel), fd_(fd), buf_(buf), bufLen_(bufLen), remaining_(bodyLen) {}
+
+    // chunk stays valid until the next call. False at the end of the body or on a broken connection.
+    Task<bool> Next(std::string_view& chunk);
+
+    // Discards whatever the handler did not consume, keeping the stream in sync.
+    Task<bool> Skip();
+
+    // Checks the body against expected as it arrives, continuing from the crc of the header.
+    // A mismatch marks the reader failed once the last chunk is in.
+    void VerifyCrc(uint32_t crc, uint32_t expected) {
+        verify_   = true;
+        crc_      = crc;
+        expected_ = expected;
+    }
+
+    uint32_t Remaining() const { return remaining_; }
+
+    bool Failed() const { return failed_; }
+
+private:
+    Selector* sel_;
+    int fd_;
+    char* buf_;
+    uint32_t bufLen_;
+    uint32_t remaining_;
+    bool failed_{false};
+    bool verify_{false};
+    uint32_t crc_{0};
+    uint32_t expected_{0};
+};
+
+// Sends a chunked response: any number of STREAM_CHUNK frames, then one STREAM_END,
+// all tagged with the request's msgId. Chunks may go out before the request body is read.
+class ChunkWriter {
+public:
+    ChunkWriter(Selector* sel, int fd, uint32_t msgId) : sel_(sel), fd_(fd), msgId_(msgId) {}
+
+    Task<bool> Write(const std::string& data);
+
+    Task<bool> End(const std::string& data);
+
+    bool Ended() const { return ended_; }
+
+private:
+    Task<bool> _SendFrame(MsgType type, const std::string& data);
+
+private:
+    Selector* sel_;
+    int fd_;
+    uint32_t msgId_;
+    bool ended_{false};
+};
+
+// Storage is taken on the first read and may be handed back while the connection idles
+// between frames, the next read takes another.
 struct RecvBuf {
     char* recvBuf{nullptr};
+    uint32_t capacity{0};
     PMsgHead pHead{nullptr};
     uint32_t usedBuf{0};
+    uint32_t caps{0};
+    uint32_t crc{0};            // running CRC-32C of the frame being read
+    uint32_t expectCrc{0};
+    uint32_t compressSkip{0};   // replies left to send raw after one did not compress
+    uint32_t compressBackoff{0};
+    std::chrono::steady_clock::time_point waitingSince{};  // parked on the client since, zero while busy
+    WireCodec codec{CODEC_MSG_HEAD};
+    std::chrono::nanoseconds inKernel{-1};  // rx timestamp of the frame's first byte to its recvmsg
+};
+
+// Frames pushed to a subscriber, drained by its own coroutine. A published frame is shared
+// by every subscriber it went to and written straight from the shared buffer. The session's
+// replies take the same write lock, so a push never lands inside a half written reply.
+struct OutQueue {
+    std::deque<std::shared_ptr<const std::string>> frames;
+    size_t queuedBytes{0};
+    uint64_t dropped{0};
+    bool writing{false};
+    bool closing{false};        // torn down, the lock is not handed on anymore
+    std::deque<std::coroutine_handle<>> lockWaiters;
+    std::coroutine_handle<> idle{};     // the drain, parked on an empty queue
+    Task<void> drain;
+
+    // Hands the lock to the next waiter, through the ready queue so the writer finishes first.
+    void Unlock(Selector* sel, int fd) {
+        if(closing) {
+            return;
+        }
+        if(lockWaiters.empty()) {
+            writing = false;
+            return;
+        }
+        auto h = lockWaiters.front();
+        lockWaiters.pop_front();
+        sel->Ready(fd, h);
+    }
+};
+
+// Takes the write lock of fd's OutQueue. It is owned after co_await either way, false if fd got cancelled meanwhile.
+struct OutQueueLock {
+    Selector* sel;
+    int fd;
+    OutQueue* out;
+    bool await_ready() const noexcept {
+        if(!out->writing) {
+            out->writing = true;
+            return true;
+        }
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> h) {
+        out->lockWaiters.push_back(h);
+    }
+    bool await_resume() const noexcept { return !sel->Cancelled(fd); }
+};
+
+// Releases the write lock at scope exit, a null out holds nothing.
+struct OutQueueGuard {
+    Selector* sel;
+    int fd;
+    OutQueue* out;
+
+    OutQueueGuard(Selector* sel, int fd, OutQueue* out) : sel(sel), fd(fd), out(out) {}
+    OutQueueGuard(const OutQueueGuard&) = delete;
+    OutQueueGuard& operator=(const OutQueueGuard&) = delete;
+
+    ~OutQueueGuard() {
+        if(out) {
+            out->Unlock(sel, fd);
+        }
+    }
+};
+
+// Parks the drain until something is queued. False if fd got cancelled.
+struct OutQueueIdle {
+    Selector* sel;
+    int fd;
+    OutQueue* out;
+    bool await_ready() const noexcept { return sel->Cancelled(fd) || !out->frames.empty(); }
+    void await_suspend(std::coroutine_handle<> h) {
+        out->idle = h;
+    }
+    bool await_resume() const noexcept { return !sel->Cancelled(fd); }
+};
 
-    RecvBuf() = default;
-    explicit RecvBuf(char* buf) : recvBuf(buf) {}
+// What a publish does to a subscriber whose queue is over its limit.
+enum SlowSubscriber : uint8_t {
+    SLOW_DROP       = 0,    // the subscriber misses this message
+    SLOW_DISCONNECT = 1     // the subscriber is cut off
 };
 
 struct ReqData {
     uint32_t reqId{0};
     int32_t  reqDataLen{0};
     MsgType  type;
+    std::chrono::steady_clock::time_point deadline{};   // zero when the client set none
+    std::chrono::steady_clock::time_point arrival{};    // the header came off the socket
+    std::chrono::nanoseconds inKernel{-1};              // waited in the socket before, -1 without a kernel timestamp
 };
+
+// What happens to connections that go quiet. A connection counts as idle while its session waits
+// for the client to send; subscribers are never disconnected for it.
+struct IdleConfig {
+    std::chrono::milliseconds releaseAfter{0};  // hand back the receive buffer, 0 keeps it
+    std::chrono::milliseconds timeout{0};       // disconnect, 0 never does
+};
+
+// EnableJournal's arguments, held while a hot upgrade waits for the predecessor to close the journal.
+struct JournalConfig {
+    std::string path;
+    uint32_t batchRecords{256};
+    std::chrono::microseconds maxDelay{0};
+};
+
+// Where the time of a request goes, one histogram per leg.
+struct LatencyStats {
+    bool kernelTimestamps{false};
+    LatencyHistogram kernelToReactor;   // SO_TIMESTAMPING rx stamp to the header off the socket
+    LatencyHistogram reactorToHandler;  // body reads, rate limit, lane and lock waits
+    LatencyHistogram handlerToSend;     // handling until the reply was handed to the kernel
+};
+
+// Latency tier: the reactor spins instead of sleeping in select while traffic flows.
+struct BusyPollConfig {
+    int cpu{-1};                                // pin the reactor thread here, -1 leaves it unpinned
+    std::chrono::microseconds spinFor{1000};    // quiet time after which select blocks again
+    std::chrono::microseconds idleWait{10000};  // longest blocking wait once idle
+    uint32_t socketBusyPollUs{0};               // SO_BUSY_POLL on accepted sockets, 0 for none
+};
+
+struct Listener {
+    int fd{INVALID_SOCKET_VALUE};
+    ListenerConfig config;
+    Task<void> acceptTask;
+};
+
+struct ShmSessionState {
+    std::unique_ptr<ShmChannel> channel;
+    Task<void> session;
+    Task<void> watch;
+};
+
 class AsyncServer {
     static constexpr uint32_t BUFFER_SIZE = 10 << 20;
+    static constexpr uint32_t SUPPORTED_CAPS = CAP_CRC32C | CAP_LZ4 | CAP_DEADLINE;
+    static constexpr uint32_t COMPRESS_MIN_SIZE = 4 << 10;
+    static constexpr uint32_t COMPRESS_MAX_BACKOFF = 64;
+    static constexpr uint32_t STREAM_CHUNK_SIZE = 256 << 10;
+    static constexpr uint32_t SHM_RING_SIZE = 4 << 20;
+    static constexpr size_t OUT_QUEUE_LIMIT = 4 << 20;
+    static constexpr int OUT_QUEUE_IOV = 64;
+    static constexpr uint32_t ARENA_RECV_SIZE = 64 << 10;
+    static constexpr size_t SESSION_KEEP_SIZE = 64 << 10;
+    static constexpr size_t RECV_POOL_SIZE = 8;
+    static constexpr std::chrono::milliseconds IDLE_SWEEP_MIN{10};
+    static constexpr std::chrono::milliseconds HANDOFF_POLL{10};
 public:
     AsyncServer() = default;
     ~AsyncServer();
 
     Task<bool> StartServer(uint16_t port);
 
+    // Every listener feeds the same session machinery, so TCP and unix clients are served alike.
+    bool AddListener(const ListenerConfig& config);
+
+    // MSG payloads are journaled at path and only acknowledged once a group commit made them durable.
+    bool EnableJournal(const std::string& path, uint32_t batchRecords = 256,
+                       std::chrono::microseconds maxDelay = std::chrono::microseconds(0));
+
+    // Replies to the given types are cached by payload and replayed without running the handler.
+    void EnableResponseCache(size_t budget, std::chrono::milliseconds ttl, std::vector<MsgType> types = {MsgType::REQ});
+
+    // Sources over maxConnPerIp connections or out of request tokens are refused at accept,
+    // connections out of tokens have their next read held back on a reactor timer.
+    void EnableRateLimit(const RateLimit& perIp, const RateLimit& perConn, uint32_t maxConnPerIp = 0);
+
+    // Applies once a subscriber has queueLimit bytes of published frames it did not read yet.
+    void SetSlowSubscriberPolicy(SlowSubscriber policy, size_t queueLimit = OUT_QUEUE_LIMIT) {
+        slowPolicy_ = policy;
+        outQueueLimit_ = queueLimit;
+    }
+
+    // Local clients connect to path and get a shared-memory ring pair (see ShmClient).
+    bool StartShmListener(const std::string& path, uint32_t ringSize = SHM_RING_SIZE);
+
+    // A connection is scheduled in the lane of the request type it read last.
+    void SetTypeLane(MsgType type, Lane lane) { mapType2Lane_[type] = lane; }
+
+    // Resumes per reactor tick a lane gets before the next lane's turn.
+    void SetLaneBudget(Lane lane, uint32_t budget) { sel_.laneBudget[lane] = std::max(1u, budget); }
+
+    // Takes effect for the thread that calls RunServer.
+    void EnableBusyPoll(const BusyPollConfig& config) {
+        busyPoll_ = config;
+        sel_.spinFor  = config.spinFor;
+        sel_.idleWait = config.idleWait;
+    }
+
+    // Checked by a reactor timer a few times per period, so either may act up to half a period late.
+    void SetIdlePolicy(const IdleConfig& config) { idle_ = config; }
+
+    // Receive buffers and coroutine frames of the reactor come from a HugePageArena of up to
+    // limit bytes. An arena receive buffer holds ARENA_RECV_SIZE, a connection sending larger
+    // frames moves to a heap buffer. Takes effect for the thread that calls RunServer.
+    void EnableHugePages(size_t limit) { hugePageLimit_ = limit; }
+
+    // False when the reactor has no arena.
+    bool GetArenaStats(HugePageArena::Stats& stats) const;
+
+    // Hot upgrade, old side. A successor calling TakeOver(path) gets the listeners at once, then every
+    // connection as it reaches a frame boundary, idle ones with the partial frame they sent so far.
+    // Without handoffConnections they are served here until they close instead. Subscribers, streamed
+    // uploads and shm clients stay too; whatever is left after drainTimeout is closed and RunServer returns.
+    bool EnableHotUpgrade(const std::string& path, bool handoffConnections = true,
+                          std::chrono::milliseconds drainTimeout = std::chrono::milliseconds(5000));
+
+    // Hot upgrade, new side, in place of StartServer and AddListener: accepts on the listeners of the
+    // process that runs EnableHotUpgrade at path, its connections follow while RunServer runs. Call it
+    // before EnableJournal, MSG requests wait for the journal until the predecessor closed it.
+    // False when nothing takes over at path.
+    bool TakeOver(const std::string& path);
+
+    // Records every MsgHead request into LatencyStats. kernelTimestamps asks for SO_TIMESTAMPING
+    // software rx stamps on accepted sockets, read by the first recvmsg of each frame.
+    void EnableLatencyTrace(bool kernelTimestamps = true);
+
+    // nullptr until EnableLatencyTrace.
+    const LatencyStats* GetLatencyStats() const { return latency_.get(); }
+
+    // In-process client: the server end of a socketpair is served like an accepted connection and the
+    // other end returned, non-blocking, for the caller to close. Together with RunOnce a driver on
+    // the reactor thread pushes requests through the sessions without any network (see LocalBench).
+    int ConnectLocal(WireCodec codec = CODEC_MSG_HEAD);
+
     void RunServer();
 
+    // One reactor tick: ready coroutines, due timers, journal commits and reaping of closed sessions.
+    void RunOnce();
+
 private:
     void StopServer();
 
-    Task<void> AcceptLoop();
+    // Suspends a _Persist while a hot upgrade keeps the journal closed.
+    struct JournalOpened {
+        AsyncServer* server;
+        bool await_ready() const noexcept { return !server->adopting_; }
+        void await_suspend(std::coroutine_handle<> h) {
+            server->journalWaiters_.push_back(h);
+        }
+        void await_resume() const noexcept {}
+    };
+
+    static bool _Expired(const ReqData& req) {
+        return req.deadline != std::chrono::steady_clock::time_point{} && std::chrono::steady_clock::now() > req.deadline;
+    }
+
+    Lane _LaneOf(MsgType type) const {
+        auto itr = mapType2Lane_.find(type);
+        return itr == mapType2Lane_.end() ? LANE_INTERACTIVE : itr->second;
+    }
+
+    bool _StartListener(int listenFd, const ListenerConfig& config);
+
+    Task<void> AcceptLoop(int listenFd, WireCodec codec);
+
+    // Registers a connection whose RecvBuf is in place and starts its session.
+    void _StartSession(int clientFd, WireCodec codec);
+
+    std::string _FormatPeer(const struct sockaddr_storage& addr);
 
     Task<void> SessionEcho(int clientFd);
 
+    // Serves a connection through the shared Connection engine: reads whatever is available,
+    // decodes every complete request in the buffer and sends all their replies together.
+    Task<void> SessionCodec(int clientFd, WireCodec codec);
+
+    Task<void> ShmAcceptLoop();
+
+    Task<void> ShmSession(ShmChannel* channel);
+
+    Task<void> ShmWatch(int ctrlFd, ShmChannel* channel);
+
+    bool _SendShmHandshake(int ctrlFd, const ShmChannel& channel);
+
+    // Hands the listeners and then the connections to the successor connecting at the upgrade socket.
+    Task<void> UpgradeLoop();
+
+    // Sends fd to the successor if its session sits at a frame boundary, the session then ends here.
+    bool _HandOff(int fd);
+
+    // Receives the predecessor's connections until it drained, then opens the journal.
+    Task<void> AdoptLoop();
+
+    void _AdoptConnection(HandoffRecord& record);
+
+    // Streamed types return after the header, leaving the body in the socket for a BodyReader.
     Task<ReqData> ReadData(int clientFd, std::string& readData);
 
-    Task<void> SendData(int clientFd, const std::string& data);
+    // Gives recvBuf storage, from the arena while it has room, else from the pool or the heap.
+    void _AcquireRecvBuf(RecvBuf& recvBuf);
+
+    // Returns recvBuf's storage to where it came from, keeping the rest of its state.
+    void _ReleaseRecvBuf(RecvBuf& recvBuf);
+
+    // Releases the receive buffers of sessions idle past releaseAfter, cuts off those idle past timeout.
+    Task<void> IdleSweep();
+
+    // A string that grew past SESSION_KEEP_SIZE for one large request gives the memory back.
+    static void _Trim(std::string& buf) {
+        if(buf.capacity() > SESSION_KEEP_SIZE) {
+            std::string().swap(buf);
+        }
+    }
+
+    // Grows recvBuf to hold len bytes, keeping what it holds. False if len exceeds BUFFER_SIZE.
+    bool _ReserveRecvBuf(RecvBuf& recvBuf, uint32_t len);
+
+    // recv that also takes the kernel rx timestamp of the first byte into recvBuf.inKernel.
+    int _RecvStamped(int clientFd, RecvBuf& recvBuf, uint32_t len);
+
+    // Appends len bytes to recvBuf, folding them into the running crc when checksum is set.
+    Task<bool> _RecvExact(int clientFd, RecvBuf& recvBuf, uint32_t len, bool checksum);
+
+    Task<bool> SessionStream(int clientFd, const ReqData& req);
+
+    void _Negotiate(int clientFd, const ReqData& req, const std::string& reqMsg, Response& response);
+
+    static bool _IsPubSub(MsgType type) {
+        return MsgType::SUBSCRIBE == type || MsgType::UNSUBSCRIBE == type || MsgType::PUBLISH == type;
+    }
+
+    // SUBSCRIBE gives the connection its OutQueue on first use.
+    void _HandlePubSub(int clientFd, MsgType type, const std::string& reqMsg, std::string& respMsg);
+
+    // Queues frame for fd, or applies the slow subscriber policy. False if it was not queued.
+    bool _Deliver(int fd, const std::shared_ptr<const std::string>& frame);
+
+    // Writes queued frames in batches while holding the connection's write lock.
+    Task<void> SubscriberDrain(int clientFd, OutQueue* out);
+
+    void _DropSubscriber(int clientFd);
+
+    // Sends every yielded frame as STREAM_CHUNK, then STREAM_END. The producer is only
+    // resumed once the previous frame is on the wire, so a slow reader throttles it.
+    Task<bool> SendStream(int clientFd, uint32_t msgId, AsyncGenerator<std::string>& frames);
+
+    // Sends the frame, then the file or pipe body via sendfile/splice. False means the stream is broken.
+    Task<bool> SendData(int clientFd, const Response& response);
+
+    bool _NeedPersist(MsgType type) const {
+        return (journal_ || deferredJournal_) && (MsgType::MSG == type || MsgType::BATCH == type);
+    }
+
+    // Journals a MSG payload, or every MSG inside a BATCH, and waits for the commit.
+    Task<bool> _Persist(MsgType type, const std::string& payload);
+
+    // Sends a cached frame with the msgId swapped in front of it, without touching the cached bytes.
+    Task<bool> SendCached(int clientFd, uint32_t msgId, const std::string& frame);
 
-    void _MakeResponse(uint32_t msgId, MsgType type, const std::string& respMsg, std::string& response);
+    // bodyLen counts body bytes sent after the frame, outside of respMsg.
+    void _MakeResponse(uint32_t msgId, MsgType type, const std::string& respMsg, std::string& response, uint32_t bodyLen = 0);
+
+    // Builds an LZ4 frame when the client agreed to CAP_LZ4 and the reply is worth it. False leaves
+    // response untouched for _MakeResponse; replies that barely shrink back off the next attempts.
+    bool _MakeCompressedResponse(RecvBuf& recvBuf, uint32_t msgId, MsgType type, const std::string& respMsg, std::string& response);
 
 private:
-    int listenSocket_{INVALID_SOCKET_VALUE};
+    std::vector<Listener> listeners_;
 
     bool running_{false};
 
@@ -340,9 +1080,79 @@ private:
 
     uint16_t port_{0};
 
-    Task<void> acceptTask_;
+    // cancelled by StopServer, every listener and connection waits under it or a child of it
+    CancelToken stopToken_{CancelToken::Create()};
 
     std::unordered_map<int, Task<void>> mapFd2Task_;
     
     std::unordered_map<int, RecvBuf> mapFd2RecvBuf_;
+
+    std::unordered_map<int, Lane> mapType2Lane_{
+        {MsgType::MSG, LANE_BULK}, {MsgType::BLOB, LANE_BULK}, {MsgType::UPLOAD, LANE_BULK},
+        {MsgType::LIST, LANE_BULK}, {MsgType::BATCH, LANE_BULK}
+    };
+
+    std::unique_ptr<ResponseCache> respCache_;
+
+    std::unique_ptr<Journal> journal_;
+
+    std::unique_ptr<RateLimiter> rateLimiter_;
+
+    std::unique_ptr<LatencyStats> latency_;
+
+    PubSub pubSub_;
+
+    std::unordered_map<int, std::unique_ptr<OutQueue>> mapFd2OutQueue_;
+
+    SlowSubscriber slowPolicy_{SLOW_DROP};
+
+    BusyPollConfig busyPoll_{-1, std::chrono::microseconds(0)};
+
+    size_t outQueueLimit_{OUT_QUEUE_LIMIT};
+
+    IdleConfig idle_;
+
+    Task<void> idleSweep_;
+
+    std::vector<char*> recvPool_;     // BUFFER_SIZE heap buffers of closed or idle connections
+
+    size_t hugePageLimit_{0};
+
+    HugePageArena* arena_{nullptr};
+
+    int shmListenSocket_{INVALID_SOCKET_VALUE};
+
+    std::string shmPath_;
+
+    uint32_t shmRingSize_{SHM_RING_SIZE};
+
+    Task<void> shmAcceptTask_;
+
+    std::unordered_map<int, ShmSessionState> mapFd2ShmSession_;
+
+    int upgradeListenFd_{INVALID_SOCKET_VALUE};
+
+    std::string upgradePath_;
+
+    bool handoffConnections_{true};
+
+    std::chrono::milliseconds drainTimeout_{0};
+
+    Task<void> upgradeTask_;
+
+    int handoffFd_{INVALID_SOCKET_VALUE};   // to the successor, or from the predecessor
+
+    bool handingOver_{false};               // the successor accepts on our listeners
+
+    bool journalHandedOver_{false};         // closed for the successor, nothing is journaled here anymore
+
+    uint32_t handoffCount_{0};              // connections sent to the successor
+
+    bool adopting_{false};                  // the predecessor still drains and holds the journal
+
+    Task<void> adoptTask_;
+
+    std::optional<JournalConfig> deferredJournal_;
+
+    std::vector<std::coroutine_handle<>> journalWaiters_;
 };
\ No newline at end of file
@@ -0,0 +1,104 @@
+#include "Crc32c.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+namespace {
+
+const uint32_t CRC32C_POLY = 0x82f63b78;
+
+struct Crc32cTable {
+    uint32_t table[256];
+
+    Crc32cTable() {
+        for(uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for(int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+            }
+            table[i] = crc;
+        }
+    }
+};
+
+const Crc32cTable crcTable;
+
+uint32_t Crc32cSoft(uint32_t crc, const uint8_t* p, size_t len) {
+    while(len--) {
+        crc = crcTable.table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t Crc32cHw(uint32_t crc, const uint8_t* p, size_t len) {
+    for(; len > 0 && ((uintptr_t)p & 7); --len) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    uint64_t crc64 = crc;
+    for(; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for(; len > 0; --len) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+
+bool HwSupported() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+uint32_t Crc32cHw(uint32_t crc, const uint8_t* p, size_t len) {
+    for(; len > 0 && ((uintptr_t)p & 7); --len) {
+        crc = __crc32cb(crc, *p++);
+    }
+    for(; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for(; len > 0; --len) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+
+bool HwSupported() {
+    return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+#else
+uint32_t Crc32cHw(uint32_t crc, const uint8_t* p, size_t len) {
+    return Crc32cSoft(crc, p, len);
+}
+
+bool HwSupported() {
+    return false;
+}
+#endif
+
+// picked once, the cpu does not change under us
+using Crc32cImpl = uint32_t (*)(uint32_t, const uint8_t*, size_t);
+const Crc32cImpl crcImpl = HwSupported() ? Crc32cHw : Crc32cSoft;
+
+}
+
+uint32_t Crc32c(uint32_t crc, const void* data, size_t len) {
+    return ~crcImpl(~crc, static_cast<const uint8_t*>(data), len);
+}
+
+bool Crc32cHardware() {
+    return crcImpl == Crc32cHw;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli). Pass the previous result as crc to checksum data in pieces, 0 to start.
+uint32_t Crc32c(uint32_t crc, const void* data, size_t len);
+
+// True when Crc32c runs on the SSE4.2 / ARMv8 crc instructions instead of the table.
+bool Crc32cHardware();
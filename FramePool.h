@@ -0,0 +1,109 @@
+#pragma once
+
+#include "HugePageArena.h"
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+// Recycles coroutine frames. Every Task call allocates a frame, so one request that awaits
+// a few helpers would go to the heap several times; a freed frame is kept instead on a
+// per-thread free list of its size class and handed out again, so once the lists are warm
+// a request allocates nothing. Frames larger than the biggest class go to the heap as before.
+// New frames come from the thread's HugePageArena when it has one.
+class FramePool {
+    static constexpr size_t CLASS_SIZE = 64;
+    static constexpr size_t CLASS_NUM  = 64;    // frames up to 4 KB are pooled
+public:
+    struct Stats {
+        uint64_t allocated{0};  // frames taken from the heap or the arena by this thread
+        uint64_t cached{0};     // of which sitting on the free lists
+    };
+
+    static void* Allocate(size_t size) {
+        size_t cls = _Class(size);
+        if(cls >= CLASS_NUM) {
+            return ::operator new(size);
+        }
+        Local& local = _Local();
+        if(FreeFrame* frame = local.free[cls]) {
+            local.free[cls] = frame->next;
+            --local.stats.cached;
+            return frame;
+        }
+        ++local.stats.allocated;
+        if(HugePageArena* arena = HugePageArena::Local()) {
+            if(void* frame = arena->Allocate((cls + 1) * CLASS_SIZE)) {
+                return frame;
+            }
+        }
+        return ::operator new((cls + 1) * CLASS_SIZE);
+    }
+
+    static void Release(void* ptr, size_t size) {
+        size_t cls = _Class(size);
+        Local& local = _Local();
+        if(cls >= CLASS_NUM) {
+            ::operator delete(ptr);
+            return;
+        }
+        if(local.closed) {
+            _Free(ptr, (cls + 1) * CLASS_SIZE);
+            return;
+        }
+        auto frame = static_cast<FreeFrame*>(ptr);
+        frame->next = local.free[cls];
+        local.free[cls] = frame;
+        ++local.stats.cached;
+    }
+
+    static Stats LocalStats() {
+        return _Local().stats;
+    }
+
+private:
+    struct FreeFrame {
+        FreeFrame* next;
+    };
+
+    // trivially destructible, so frames released while the thread exits still find it
+    struct Local {
+        FreeFrame* free[CLASS_NUM];
+        Stats stats;
+        bool closed;
+    };
+
+    // returns the cached frames to the heap at thread exit
+    struct Drain {
+        Local* local;
+        ~Drain() {
+            local->closed = true;
+            for(auto& head : local->free) {
+                while(FreeFrame* frame = head) {
+                    head = frame->next;
+                    _Free(frame, (&head - local->free + 1) * CLASS_SIZE);
+                }
+            }
+            local->stats.cached = 0;
+        }
+    };
+
+    static Local& _Local() {
+        static thread_local Local local{};
+        static thread_local Drain drain{&local};
+        (void)drain;
+        return local;
+    }
+
+    static void _Free(void* ptr, size_t size) {
+        HugePageArena* arena = HugePageArena::Local();
+        if(arena && arena->Owns(ptr)) {
+            arena->Release(ptr, size);
+        } else {
+            ::operator delete(ptr);
+        }
+    }
+
+    static size_t _Class(size_t size) {
+        return size ? (size - 1) / CLASS_SIZE : 0;
+    }
+};
@@ -0,0 +1,135 @@
+#include "Handoff.h"
+#include "Logger.h"
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+// Reads exactly len bytes, false on EOF or error.
+bool RecvAll(int sock, char* buf, size_t len) {
+    while(len > 0) {
+        ssize_t ret = recv(sock, buf, len, MSG_WAITALL);
+        if(ret < 0 && EINTR == errno) {
+            continue;
+        }
+        if(ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+}
+
+bool SetHandoffTimeout(int sock) {
+    struct timeval timeout{HANDOFF_TIMEOUT_MS / 1000, (HANDOFF_TIMEOUT_MS % 1000) * 1000};
+    if(-1 == setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))
+        || -1 == setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))) {
+        ERROR_LOG("setsockopt handoff timeout failed, errno: %d, error: %s", errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool SendHandoff(int sock, const HandoffRecord& record) {
+    HandoffHead head{HANDOFF_MAGIC, HANDOFF_VERSION, record.kind, record.family, record.port, record.codec,
+                     record.caps, (uint32_t)record.address.length(), (uint32_t)record.pending.length()};
+    struct iovec iov[3] = {
+        {&head, sizeof(head)},
+        {(void*)record.address.data(), record.address.length()},
+        {(void*)record.pending.data(), record.pending.length()}
+    };
+    char ctrlBuf[CMSG_SPACE(sizeof(int))]{};
+    struct msghdr msg{};
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = 3;
+    if(record.fd >= 0) {
+        msg.msg_control    = ctrlBuf;
+        msg.msg_controllen = sizeof(ctrlBuf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &record.fd, sizeof(int));
+    }
+
+    // the fd goes with the first bytes, a short write only leaves plain data to follow
+    while(msg.msg_iovlen > 0) {
+        ssize_t ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if(ret < 0) {
+            if(EINTR == errno) {
+                continue;
+            }
+            ERROR_LOG("send handoff record kind[%u] failed, errno: %d, error: %s", record.kind, errno, strerror(errno));
+            return false;
+        }
+        msg.msg_control    = nullptr;
+        msg.msg_controllen = 0;
+        while(msg.msg_iovlen > 0 && (size_t)ret >= msg.msg_iov->iov_len) {
+            ret -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+        if(msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + ret;
+            msg.msg_iov->iov_len -= ret;
+        }
+    }
+    return true;
+}
+
+bool RecvHandoff(int sock, HandoffRecord& record) {
+    HandoffHead head{};
+    struct iovec iov{&head, sizeof(head)};
+    char ctrlBuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg{};
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctrlBuf;
+    msg.msg_controllen = sizeof(ctrlBuf);
+    ssize_t ret;
+    do {
+        ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while(ret < 0 && EINTR == errno);
+    if(ret <= 0) {
+        if(ret < 0) {
+            ERROR_LOG("recv handoff record failed, errno: %d, error: %s", errno, strerror(errno));
+        }
+        return false;
+    }
+
+    record.fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg && SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&record.fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    bool valid = ret == sizeof(head) && HANDOFF_MAGIC == head.magic && HANDOFF_VERSION == head.version
+        && head.addressLen < sizeof(sockaddr_un::sun_path) && head.pendingLen <= HANDOFF_MAX_PENDING;
+    if(!valid) {
+        ERROR_LOG("handoff record len[%ld] magic[%x] version[%u] malformed", (long)ret, head.magic, head.version);
+    } else {
+        record.address.resize(head.addressLen);
+        record.pending.resize(head.pendingLen);
+        valid = RecvAll(sock, record.address.data(), head.addressLen) && RecvAll(sock, record.pending.data(), head.pendingLen);
+    }
+    if(!valid) {
+        if(record.fd >= 0) {
+            close(record.fd);
+            record.fd = -1;
+        }
+        return false;
+    }
+
+    record.kind   = (HandoffKind)head.kind;
+    record.family = head.family;
+    record.port   = head.port;
+    record.codec  = (WireCodec)head.codec;
+    record.caps   = head.caps;
+    return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "Codec.h"
+#include <cstdint>
+#include <string>
+
+const uint32_t HANDOFF_MAGIC   = 0x484e4446;
+const uint32_t HANDOFF_VERSION = 1;
+
+// Largest partial frame a connection is handed over with, longer ones finish in the old process.
+const uint32_t HANDOFF_MAX_PENDING = 64 << 10;
+
+// Longest a blocking send or receive on the handoff socket may take before the peer counts as gone.
+const uint32_t HANDOFF_TIMEOUT_MS = 2000;
+
+// What an upgrading process sends its successor, in this order: every listener, LISTENERS_DONE
+// (echoed back once the successor accepts on them), connections as they reach a frame boundary,
+// then END once it drained and closed its journal.
+enum HandoffKind : uint32_t {
+    HANDOFF_LISTENER       = 1,
+    HANDOFF_LISTENERS_DONE = 2,
+    HANDOFF_CONNECTION     = 3,
+    HANDOFF_END            = 4
+};
+
+// Fixed part of a record on the wire, followed by addressLen bytes of address and
+// pendingLen bytes of a partial frame. A record carries at most one fd as SCM_RIGHTS.
+struct HandoffHead {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t kind;
+    int32_t  family;
+    uint32_t port;
+    uint32_t codec;
+    uint32_t caps;
+    uint32_t addressLen;
+    uint32_t pendingLen;
+};
+
+struct HandoffRecord {
+    HandoffKind kind{HANDOFF_END};
+    int fd{-1};                 // owned by the receiver once RecvHandoff returned it
+    // listener
+    int family{0};
+    std::string address;
+    uint16_t port{0};
+    WireCodec codec{CODEC_MSG_HEAD};
+    // connection
+    uint32_t caps{0};           // extensions the client negotiated with HELLO
+    std::string pending;        // bytes of the next frame already read off the socket
+};
+
+// Applies HANDOFF_TIMEOUT_MS to sock, a stuck peer must not hang the reactor.
+bool SetHandoffTimeout(int sock);
+
+// Both block, sock is a connected unix stream socket. False once the peer is gone or broke the format.
+bool SendHandoff(int sock, const HandoffRecord& record);
+
+bool RecvHandoff(int sock, HandoffRecord& record);
@@ -0,0 +1,118 @@
+#include "HugePageArena.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+
+namespace {
+
+thread_local HugePageArena* localArena = nullptr;
+
+}
+
+HugePageArena::HugePageArena(size_t limit) : limit_(std::max(CHUNK_SIZE, (limit + CHUNK_SIZE - 1) & ~(CHUNK_SIZE - 1))) {}
+
+HugePageArena::~HugePageArena() {
+    for(auto chunk : chunks_) {
+        munmap(chunk, CHUNK_SIZE);
+    }
+}
+
+HugePageArena* HugePageArena::Local() {
+    return localArena;
+}
+
+HugePageArena* HugePageArena::EnableLocal(size_t limit) {
+    if(!localArena) {
+        localArena = new HugePageArena(limit);
+        INFO_LOG("huge page arena enabled for this thread, limit[%lu] bytes", localArena->limit_);
+    }
+    return localArena;
+}
+
+void* HugePageArena::Allocate(size_t size) {
+    size = _Round(std::max<size_t>(size, 1));
+    if(size > CHUNK_SIZE) {
+        ++stats_.refused;
+        return nullptr;
+    }
+
+    auto itr = mapSize2Free_.find(size);
+    if(itr != mapSize2Free_.end() && itr->second) {
+        FreeBlock* block = itr->second;
+        itr->second = block->next;
+        stats_.cached -= size;
+        stats_.inUse  += size;
+        stats_.peak    = std::max(stats_.peak, stats_.inUse);
+        return block;
+    }
+
+    // the tail of a chunk too short for this block is left unused
+    if(left_ < size && !_MapChunk()) {
+        ++stats_.refused;
+        return nullptr;
+    }
+    void* block = cursor_;
+    cursor_ += size;
+    left_   -= size;
+    stats_.inUse += size;
+    stats_.peak   = std::max(stats_.peak, stats_.inUse);
+    return block;
+}
+
+void HugePageArena::Release(void* ptr, size_t size) {
+    size = _Round(std::max<size_t>(size, 1));
+    auto block = static_cast<FreeBlock*>(ptr);
+    auto& head = mapSize2Free_[size];
+    block->next = head;
+    head = block;
+    stats_.inUse  -= size;
+    stats_.cached += size;
+}
+
+bool HugePageArena::Owns(const void* ptr) const {
+    auto chunk = (char*)((uintptr_t)ptr & ~(uintptr_t)(CHUNK_SIZE - 1));
+    return std::binary_search(chunks_.begin(), chunks_.end(), chunk);
+}
+
+bool HugePageArena::_MapChunk() {
+    if((chunks_.size() + 1) * CHUNK_SIZE > limit_) {
+        return false;
+    }
+
+    bool hugetlb = true;
+    char* chunk = (char*)mmap(nullptr, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(MAP_FAILED == chunk) {
+        if(!warnedHugetlb_) {
+            WARN_LOG("mmap MAP_HUGETLB failed, errno: %d, error: %s, falling back to transparent huge pages", errno, strerror(errno));
+            warnedHugetlb_ = true;
+        }
+        hugetlb = false;
+        // over-map so a 2 MB aligned run can be cut out, THP only backs aligned ranges
+        char* raw = (char*)mmap(nullptr, CHUNK_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(MAP_FAILED == raw) {
+            ERROR_LOG("mmap arena chunk failed, errno: %d, error: %s", errno, strerror(errno));
+            return false;
+        }
+        chunk = (char*)(((uintptr_t)raw + CHUNK_SIZE - 1) & ~(uintptr_t)(CHUNK_SIZE - 1));
+        if(chunk > raw) {
+            munmap(raw, chunk - raw);
+        }
+        munmap(chunk + CHUNK_SIZE, raw + CHUNK_SIZE * 2 - (chunk + CHUNK_SIZE));
+        if(-1 == madvise(chunk, CHUNK_SIZE, MADV_HUGEPAGE)) {
+            WARN_LOG("madvise MADV_HUGEPAGE failed, errno: %d, error: %s", errno, strerror(errno));
+        }
+    }
+    // fault the page in on this thread, before anything latency sensitive touches it
+    chunk[0] = 0;
+
+    chunks_.insert(std::upper_bound(chunks_.begin(), chunks_.end(), chunk), chunk);
+    cursor_ = chunk;
+    left_   = CHUNK_SIZE;
+    ++stats_.chunks;
+    if(hugetlb) {
+        ++stats_.hugetlbChunks;
+    }
+    return true;
+}
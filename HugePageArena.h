@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Memory carved out of 2 MB pages, so a reactor's receive buffers and coroutine frames sit
+// on a few huge TLB entries instead of being spread over the heap. Chunks are mapped with
+// MAP_HUGETLB when the system has huge pages reserved, otherwise as aligned anonymous memory
+// marked for transparent huge pages. A chunk is faulted in by the thread that maps it, which
+// keeps it on that thread's NUMA node under the default first-touch policy.
+//
+// Blocks are 64-byte aligned and recycled per size; an arena never returns chunks to the
+// system. Not thread safe, every reactor thread has its own (see Local).
+class HugePageArena {
+    static constexpr size_t CHUNK_SIZE = 2 << 20;
+    static constexpr size_t BLOCK_ALIGN = 64;
+public:
+    struct Stats {
+        uint64_t chunks{0};         // 2 MB chunks mapped
+        uint64_t hugetlbChunks{0};  // of which from the MAP_HUGETLB pool, the rest rely on THP
+        uint64_t inUse{0};          // bytes handed out and not released
+        uint64_t peak{0};
+        uint64_t cached{0};         // released bytes waiting on the free lists
+        uint64_t refused{0};        // allocations over the limit, left to the heap
+    };
+
+    // limit caps the mapped bytes, rounded up to whole chunks.
+    explicit HugePageArena(size_t limit);
+    ~HugePageArena();
+
+    HugePageArena(const HugePageArena&) = delete;
+    HugePageArena& operator=(const HugePageArena&) = delete;
+
+    // nullptr when size exceeds a chunk or the limit is reached, the caller falls back to the heap.
+    void* Allocate(size_t size);
+
+    // size has to be the one ptr was allocated with.
+    void Release(void* ptr, size_t size);
+
+    bool Owns(const void* ptr) const;
+
+    const Stats& GetStats() const { return stats_; }
+
+    // The calling thread's arena, nullptr until EnableLocal ran on it.
+    static HugePageArena* Local();
+
+    // Creates the calling thread's arena on first use. It stays mapped until the process exits,
+    // so blocks released late in teardown still have somewhere to go.
+    static HugePageArena* EnableLocal(size_t limit);
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    bool _MapChunk();
+
+    static size_t _Round(size_t size) {
+        return (size + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+    }
+
+private:
+    size_t limit_;
+
+    std::vector<char*> chunks_;     // sorted, for Owns
+
+    char* cursor_{nullptr};
+
+    size_t left_{0};                // unused bytes behind cursor_ in the newest chunk
+
+    std::unordered_map<size_t, FreeBlock*> mapSize2Free_;
+
+    Stats stats_;
+
+    bool warnedHugetlb_{false};
+};
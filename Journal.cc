@@ -0,0 +1,164 @@
+#include "Journal.h"
+#include "Crc32c.h"
+#include "Logger.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+uint32_t RecordCrc(uint32_t len, const char* payload) {
+    return Crc32c(Crc32c(0, &len, sizeof(len)), payload, len);
+}
+
+}
+
+Journal::~Journal() {
+    if(base_) {
+        Flush();
+        munmap(base_, mapLen_);
+        base_ = nullptr;
+    }
+    if(-1 != fd_) {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+bool Journal::Open(const std::string& path, const std::function<void(std::string_view)>& replay) {
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(-1 == fd_) {
+        ERROR_LOG("open journal[%s] failed, errno: %d, error: %s", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if(-1 == fstat(fd_, &st)) {
+        ERROR_LOG("fstat journal failed, errno: %d, error: %s", errno, strerror(errno));
+        return false;
+    }
+    size_t fileLen = st.st_size;
+    if(fileLen < GROW_SIZE) {
+        fileLen = GROW_SIZE;
+        if(-1 == ftruncate(fd_, fileLen)) {
+            ERROR_LOG("ftruncate journal failed, errno: %d, error: %s", errno, strerror(errno));
+            return false;
+        }
+    }
+
+    base_ = (char*)mmap(nullptr, fileLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if(MAP_FAILED == base_) {
+        base_ = nullptr;
+        ERROR_LOG("mmap journal failed, errno: %d, error: %s", errno, strerror(errno));
+        return false;
+    }
+    mapLen_ = fileLen;
+
+    // the file is zero filled past the tail, and a zero header never has a matching crc
+    uint64_t records = 0;
+    RecordHead head;
+    while(tail_ + sizeof(RecordHead) <= mapLen_) {
+        memcpy(&head, base_ + tail_, sizeof(head));
+        const char* payload = base_ + tail_ + sizeof(RecordHead);
+        if(head.len > mapLen_ - tail_ - sizeof(RecordHead) || head.crc != RecordCrc(head.len, payload)) {
+            break;
+        }
+        replay(std::string_view(payload, head.len));
+        tail_ += sizeof(RecordHead) + head.len;
+        ++records;
+    }
+
+    // wipe a torn record so it can not be mistaken for data after the next append
+    size_t garbage = std::min<size_t>(mapLen_ - tail_, sizeof(RecordHead));
+    memset(base_ + tail_, 0, garbage);
+    committed_ = tail_;
+    INFO_LOG("journal[%s] replayed %lu records, %lu bytes", path.c_str(), records, tail_);
+    return true;
+}
+
+void Journal::SetCommitPolicy(uint32_t batchRecords, std::chrono::microseconds maxDelay) {
+    batchRecords_ = std::max(1u, batchRecords);
+    maxDelay_     = maxDelay;
+}
+
+uint64_t Journal::Append(const char* data, uint32_t len) {
+    if(failed_ || !base_) {
+        return 0;
+    }
+
+    size_t need = sizeof(RecordHead) + len;
+    // keep room for the zero header that terminates replay
+    if(tail_ + need + sizeof(RecordHead) > mapLen_
+        && !_Remap(mapLen_ + std::max(GROW_SIZE, need + sizeof(RecordHead)))) {
+        return 0;
+    }
+
+    RecordHead head{RecordCrc(len, data), len};
+    memcpy(base_ + tail_ + sizeof(RecordHead), data, len);
+    memcpy(base_ + tail_, &head, sizeof(head));
+    tail_ += need;
+
+    if(0 == pendingRecords_++) {
+        oldestPending_ = std::chrono::steady_clock::now();
+    }
+    return tail_;
+}
+
+void Journal::Poll() {
+    if(0 == pendingRecords_) {
+        return;
+    }
+    if(pendingRecords_ < batchRecords_ && maxDelay_.count() > 0
+        && std::chrono::steady_clock::now() - oldestPending_ < maxDelay_) {
+        return;
+    }
+    _Commit();
+}
+
+void Journal::Flush() {
+    if(pendingRecords_ > 0 || !waiters_.empty()) {
+        _Commit();
+    }
+}
+
+void Journal::_Commit() {
+    if(!failed_ && committed_ < tail_) {
+        // dirty pages of a shared mapping are page cache pages, fdatasync writes them back
+        if(-1 == fdatasync(fd_)) {
+            ERROR_LOG("journal fdatasync failed, errno: %d, error: %s", errno, strerror(errno));
+            failed_ = true;
+        } else {
+            INFO_LOG("journal group commit %u records, %lu bytes", pendingRecords_, tail_ - committed_);
+            committed_ = tail_;
+        }
+    }
+    pendingRecords_ = 0;
+
+    // waiters may append again when resumed, they are picked up by the next commit;
+    // the two lists trade places so neither gives up its capacity
+    resuming_.swap(waiters_);
+    for(auto& waiter : resuming_) {
+        if(waiter.second && !waiter.second.done()) {
+            waiter.second.resume();
+        }
+    }
+    resuming_.clear();
+}
+
+bool Journal::_Remap(size_t newLen) {
+    if(-1 == ftruncate(fd_, newLen)) {
+        ERROR_LOG("grow journal failed, errno: %d, error: %s", errno, strerror(errno));
+        return false;
+    }
+    void* base = mremap(base_, mapLen_, newLen, MREMAP_MAYMOVE);
+    if(MAP_FAILED == base) {
+        ERROR_LOG("mremap journal failed, errno: %d, error: %s", errno, strerror(errno));
+        return false;
+    }
+    base_   = (char*)base;
+    mapLen_ = newLen;
+    return true;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Append-only, memory-mapped log of acknowledged MSG payloads. Records are
+// {crc32c, len, payload} and are only acknowledged after a group commit has
+// made them durable: all records appended since the last commit share one
+// fdatasync. Open replays every intact record and cuts off a torn tail.
+class Journal {
+    static constexpr size_t GROW_SIZE = 64 << 20;
+public:
+    struct RecordHead {
+        uint32_t crc;       // over len and payload
+        uint32_t len;
+    };
+
+    Journal() = default;
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    bool Open(const std::string& path, const std::function<void(std::string_view)>& replay);
+
+    // Commit once batchRecords are pending or the oldest pending record waited maxDelay,
+    // 0 delay commits on every reactor tick that appended something.
+    void SetCommitPolicy(uint32_t batchRecords, std::chrono::microseconds maxDelay);
+
+    // Returns the position the record is durable at once committed, 0 on failure.
+    uint64_t Append(const char* data, uint32_t len);
+
+    // Called once per reactor tick. Commits when the policy says so and resumes the waiters.
+    void Poll();
+
+    // Commits whatever is pending regardless of the policy.
+    void Flush();
+
+    bool Durable(uint64_t seq) const { return committed_ >= seq; }
+
+    bool Failed() const { return failed_; }
+
+    void Wait(uint64_t seq, std::coroutine_handle<> h) { waiters_.push_back({seq, h}); }
+
+private:
+    bool _Remap(size_t newLen);
+
+    void _Commit();
+
+private:
+    int fd_{-1};
+
+    char* base_{nullptr};
+
+    size_t mapLen_{0};
+
+    uint64_t tail_{0};
+
+    uint64_t committed_{0};
+
+    bool failed_{false};
+
+    uint32_t batchRecords_{256};
+
+    std::chrono::microseconds maxDelay_{0};
+
+    uint32_t pendingRecords_{0};
+
+    std::chrono::steady_clock::time_point oldestPending_;
+
+    std::vector<std::pair<uint64_t, std::coroutine_handle<>>> waiters_;
+
+    std::vector<std::pair<uint64_t, std::coroutine_handle<>>> resuming_;
+};
+
+// co_await JournalCommit{journal, seq} suspends until seq is durable. False if the commit failed.
+struct JournalCommit {
+    Journal* journal;
+    uint64_t seq;
+
+    bool await_ready() const noexcept {
+        return journal->Durable(seq) || journal->Failed();
+    }
+    void await_suspend(std::coroutine_handle<> h) {
+        journal->Wait(seq, h);
+    }
+    bool await_resume() const noexcept {
+        return journal->Durable(seq);
+    }
+};
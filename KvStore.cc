@@ -0,0 +1,284 @@
+#include "KvStore.h"
+#include "Logger.h"
+#include <cstring>
+#include <functional>
+
+KvStore::KvStore() {
+    _Reset(DEFAULT_BUDGET, DEFAULT_SHARDS);
+}
+
+KvStore::~KvStore() {
+    for(uint32_t i = 0; i < shardNum_; ++i) {
+        for(char* chunk : shards_[i].chunks) {
+            delete[] chunk;
+        }
+    }
+}
+
+KvStore* KvStore::Instance() {
+    static KvStore instance;
+    return &instance;
+}
+
+bool KvStore::Init(size_t memoryBudget, uint32_t shardNum) {
+    if(0 == shardNum || memoryBudget / shardNum < CHUNK_SIZE) {
+        ERROR_LOG("kv budget[%lu] too small for %u shards", memoryBudget, shardNum);
+        return false;
+    }
+    if(GetStats().items != 0) {
+        ERROR_LOG("kv store already holds data, can not re-init");
+        return false;
+    }
+
+    _Reset(memoryBudget, shardNum);
+    INFO_LOG("kv store init, budget[%lu] shards[%u]", memoryBudget, shardNum);
+    return true;
+}
+
+void KvStore::_Reset(size_t memoryBudget, uint32_t shardNum) {
+    for(uint32_t i = 0; i < shardNum_; ++i) {
+        for(char* chunk : shards_[i].chunks) {
+            delete[] chunk;
+        }
+    }
+
+    shards_.reset(new Shard[shardNum]);
+    shardNum_ = shardNum;
+    budget_   = memoryBudget;
+    for(uint32_t i = 0; i < shardNum; ++i) {
+        shards_[i].budget = memoryBudget / shardNum;
+        shards_[i].tags.assign(INIT_SLOTS, SLOT_EMPTY);
+        shards_[i].slots.assign(INIT_SLOTS, nullptr);
+    }
+}
+
+size_t KvStore::MaxItemLen() const {
+    return CHUNK_SIZE - sizeof(Item);
+}
+
+bool KvStore::Get(std::string_view key, std::string& value) {
+    value.clear();
+    return AppendValue(key, value);
+}
+
+bool KvStore::AppendValue(std::string_view key, std::string& out) {
+    uint64_t hash = std::hash<std::string_view>{}(key);
+    Shard& shard = _ShardOf(hash);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    int64_t slot = _Find(shard, hash, key);
+    if(slot < 0) {
+        ++shard.misses;
+        return false;
+    }
+
+    Item* item = shard.slots[slot];
+    item->ref = 1;
+    out.append(item->Value(), item->valLen);
+    ++shard.hits;
+    return true;
+}
+
+bool KvStore::Set(std::string_view key, std::string_view value) {
+    uint64_t itemLen = sizeof(Item) + key.length() + value.length();
+    if(key.empty() || itemLen > CHUNK_SIZE) {
+        WARN_LOG("kv set rejected, key len[%lu] value len[%lu]", key.length(), value.length());
+        return false;
+    }
+
+    uint64_t hash = std::hash<std::string_view>{}(key);
+    Shard& shard = _ShardOf(hash);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    int64_t slot = _Find(shard, hash, key);
+    if(slot >= 0) {
+        _EraseSlot(shard, slot);
+    }
+
+    Item* item = _Allocate(shard, itemLen);
+    if(!item) {
+        return false;
+    }
+    item->keyLen = key.length();
+    item->valLen = value.length();
+    item->ref    = 0;
+    memcpy(item->Key(), key.data(), key.length());
+    memcpy(item->Value(), value.data(), value.length());
+    return _Insert(shard, hash, item);
+}
+
+bool KvStore::Del(std::string_view key) {
+    uint64_t hash = std::hash<std::string_view>{}(key);
+    Shard& shard = _ShardOf(hash);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    int64_t slot = _Find(shard, hash, key);
+    if(slot < 0) {
+        return false;
+    }
+    _EraseSlot(shard, slot);
+    return true;
+}
+
+KvStore::Stats KvStore::GetStats() {
+    Stats stats;
+    for(uint32_t i = 0; i < shardNum_; ++i) {
+        Shard& shard = shards_[i];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        stats.items         += shard.used;
+        stats.usedBytes     += shard.usedBytes;
+        stats.reservedBytes += shard.chunks.size() * (uint64_t)CHUNK_SIZE;
+        stats.hits          += shard.hits;
+        stats.misses        += shard.misses;
+        stats.evictions     += shard.evictions;
+    }
+    return stats;
+}
+
+int64_t KvStore::_Find(Shard& shard, uint64_t hash, std::string_view key) {
+    uint32_t mask = shard.tags.size() - 1;
+    uint8_t tag = _Tag(hash);
+    for(uint32_t i = hash & mask, probe = 0; probe <= mask; i = (i + 1) & mask, ++probe) {
+        uint8_t cur = shard.tags[i];
+        if(SLOT_EMPTY == cur) {
+            return -1;
+        }
+        if(cur != tag) {
+            continue;
+        }
+        Item* item = shard.slots[i];
+        if(item->keyLen == key.length() && 0 == memcmp(item->Key(), key.data(), key.length())) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool KvStore::_Insert(Shard& shard, uint64_t hash, Item* item) {
+    // keep probe sequences short: at most 7/8 of the slots may be full or deleted
+    if((shard.used + shard.deleted + 1) * 8 > shard.tags.size() * 7) {
+        _Grow(shard);
+    }
+
+    uint32_t mask = shard.tags.size() - 1;
+    for(uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        if(shard.tags[i] == SLOT_EMPTY || shard.tags[i] == SLOT_DELETED) {
+            if(shard.tags[i] == SLOT_DELETED) {
+                --shard.deleted;
+            }
+            shard.tags[i]  = _Tag(hash);
+            shard.slots[i] = item;
+            ++shard.used;
+            return true;
+        }
+    }
+}
+
+void KvStore::_Grow(Shard& shard) {
+    // only double when live items need it, otherwise rehashing in place drops the tombstones
+    size_t newSize = shard.used * 2 >= shard.tags.size() ? shard.tags.size() * 2 : shard.tags.size();
+    std::vector<uint8_t> tags(newSize, SLOT_EMPTY);
+    std::vector<Item*> slots(newSize, nullptr);
+    uint32_t mask = newSize - 1;
+    for(size_t i = 0; i < shard.tags.size(); ++i) {
+        if(shard.tags[i] < 0x80) {
+            continue;
+        }
+        Item* item = shard.slots[i];
+        uint64_t hash = std::hash<std::string_view>{}(std::string_view(item->Key(), item->keyLen));
+        uint32_t pos = hash & mask;
+        while(tags[pos] != SLOT_EMPTY) {
+            pos = (pos + 1) & mask;
+        }
+        tags[pos]  = shard.tags[i];
+        slots[pos] = item;
+    }
+
+    shard.tags.swap(tags);
+    shard.slots.swap(slots);
+    shard.deleted   = 0;
+    shard.clockHand = 0;
+}
+
+void KvStore::_EraseSlot(Shard& shard, uint32_t slot) {
+    _Free(shard, shard.slots[slot]);
+    shard.slots[slot] = nullptr;
+    // an empty successor ends every probe chain through this slot, so it can become empty too
+    uint32_t next = (slot + 1) & (shard.tags.size() - 1);
+    if(shard.tags[next] == SLOT_EMPTY) {
+        shard.tags[slot] = SLOT_EMPTY;
+    } else {
+        shard.tags[slot] = SLOT_DELETED;
+        ++shard.deleted;
+    }
+    --shard.used;
+}
+
+uint32_t KvStore::_SizeClass(uint32_t size) {
+    uint32_t shift = MIN_CLASS_SHIFT;
+    while((1u << shift) < size) {
+        ++shift;
+    }
+    return shift - MIN_CLASS_SHIFT;
+}
+
+KvStore::Item* KvStore::_Allocate(Shard& shard, uint32_t size) {
+    uint32_t cls = _SizeClass(size);
+    size_t blockLen = 1ul << (cls + MIN_CLASS_SHIFT);
+    if(shard.usedBytes + blockLen > shard.budget && !_Evict(shard, blockLen)) {
+        WARN_LOG("kv shard can not free %lu bytes for a new item", blockLen);
+        return nullptr;
+    }
+
+    void* block = shard.freeLists[cls];
+    if(block) {
+        shard.freeLists[cls] = *reinterpret_cast<void**>(block);
+    } else {
+        if(shard.chunkLeft < blockLen) {
+            // the tail of the old chunk is too small for this class, hand it out as smaller blocks later
+            while(shard.chunkLeft >= (1u << MIN_CLASS_SHIFT)) {
+                uint32_t tailCls = _SizeClass(shard.chunkLeft + 1) - 1;
+                size_t tailLen = 1ul << (tailCls + MIN_CLASS_SHIFT);
+                *reinterpret_cast<void**>(shard.chunkCur) = shard.freeLists[tailCls];
+                shard.freeLists[tailCls] = shard.chunkCur;
+                shard.chunkCur  += tailLen;
+                shard.chunkLeft -= tailLen;
+            }
+            shard.chunkCur  = new char[CHUNK_SIZE];
+            shard.chunkLeft = CHUNK_SIZE;
+            shard.chunks.push_back(shard.chunkCur);
+        }
+        block = shard.chunkCur;
+        shard.chunkCur  += blockLen;
+        shard.chunkLeft -= blockLen;
+    }
+
+    shard.usedBytes += blockLen;
+    Item* item = reinterpret_cast<Item*>(block);
+    item->sizeClass = cls;
+    return item;
+}
+
+void KvStore::_Free(Shard& shard, Item* item) {
+    uint32_t cls = item->sizeClass;
+    *reinterpret_cast<void**>(item) = shard.freeLists[cls];
+    shard.freeLists[cls] = item;
+    shard.usedBytes -= 1ul << (cls + MIN_CLASS_SHIFT);
+}
+
+bool KvStore::_Evict(Shard& shard, size_t need) {
+    uint32_t size = shard.tags.size();
+    // two sweeps: the first may only clear reference bits
+    for(uint32_t step = 0; step < 2 * size && shard.usedBytes + need > shard.budget; ++step) {
+        uint32_t slot = shard.clockHand;
+        shard.clockHand = (shard.clockHand + 1) & (size - 1);
+        if(shard.tags[slot] < 0x80) {
+            continue;
+        }
+        Item* item = shard.slots[slot];
+        if(item->ref) {
+            item->ref = 0;
+            continue;
+        }
+        _EraseSlot(shard, slot);
+        ++shard.evictions;
+    }
+    return shard.usedBytes + need <= shard.budget;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// In-memory key-value cache behind the GET/SET/DEL/MGET message types.
+// Keys are spread over shards by hash, each shard has its own lock, table and
+// arena, so reactor threads only contend when they touch the same shard.
+// A shard's table is open addressing over a dense array of one-byte tags
+// (64 slots per cache line); items live in size-classed arena blocks and are
+// evicted with CLOCK once the shard's share of the memory budget is used up.
+class KvStore {
+    static constexpr uint32_t CACHE_LINE      = 64;
+    static constexpr uint32_t MIN_CLASS_SHIFT = 5;
+    static constexpr uint32_t MAX_CLASS_SHIFT = 20;
+    static constexpr uint32_t CLASS_NUM       = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+    static constexpr uint32_t CHUNK_SIZE      = 1 << MAX_CLASS_SHIFT;
+    static constexpr uint32_t INIT_SLOTS      = 1024;
+    static constexpr uint8_t  SLOT_EMPTY      = 0x00;
+    static constexpr uint8_t  SLOT_DELETED    = 0x01;
+public:
+    static constexpr size_t   DEFAULT_BUDGET  = 256 << 20;
+    static constexpr uint32_t DEFAULT_SHARDS  = 16;
+
+    struct Stats {
+        uint64_t items{0};
+        uint64_t usedBytes{0};
+        uint64_t reservedBytes{0};
+        uint64_t hits{0};
+        uint64_t misses{0};
+        uint64_t evictions{0};
+    };
+
+    ~KvStore();
+
+    static KvStore* Instance();
+
+    // Only allowed while the store is empty.
+    bool Init(size_t memoryBudget, uint32_t shardNum);
+
+    bool Get(std::string_view key, std::string& value);
+
+    // Appends the value to out instead of replacing it, for multi-key replies.
+    bool AppendValue(std::string_view key, std::string& out);
+
+    bool Set(std::string_view key, std::string_view value);
+
+    bool Del(std::string_view key);
+
+    Stats GetStats();
+
+    size_t MaxItemLen() const;
+
+private:
+    struct Item {
+        uint32_t keyLen;
+        uint32_t valLen;
+        uint8_t  sizeClass;
+        uint8_t  ref;
+
+        char* Key() { return reinterpret_cast<char*>(this + 1); }
+        char* Value() { return Key() + keyLen; }
+    };
+
+    struct alignas(CACHE_LINE) Shard {
+        std::mutex lock;
+        std::vector<uint8_t> tags;
+        std::vector<Item*> slots;
+        uint32_t used{0};
+        uint32_t deleted{0};
+        uint32_t clockHand{0};
+
+        size_t budget{0};
+        size_t usedBytes{0};
+        void* freeLists[CLASS_NUM]{};
+        std::vector<char*> chunks;
+        char* chunkCur{nullptr};
+        size_t chunkLeft{0};
+
+        uint64_t hits{0};
+        uint64_t misses{0};
+        uint64_t evictions{0};
+    };
+
+    KvStore();
+
+    KvStore(const KvStore&) = delete;
+
+    KvStore& operator=(const KvStore&) = delete;
+
+    void _Reset(size_t memoryBudget, uint32_t shardNum);
+
+    Shard& _ShardOf(uint64_t hash) { return shards_[(hash >> 32) % shardNum_]; }
+
+    static uint8_t _Tag(uint64_t hash) { return 0x80 | (hash >> 57); }
+
+    int64_t _Find(Shard& shard, uint64_t hash, std::string_view key);
+
+    bool _Insert(Shard& shard, uint64_t hash, Item* item);
+
+    void _Grow(Shard& shard);
+
+    void _EraseSlot(Shard& shard, uint32_t slot);
+
+    Item* _Allocate(Shard& shard, uint32_t size);
+
+    void _Free(Shard& shard, Item* item);
+
+    bool _Evict(Shard& shard, size_t need);
+
+    static uint32_t _SizeClass(uint32_t size);
+
+private:
+    std::unique_ptr<Shard[]> shards_;
+
+    uint32_t shardNum_{0};
+
+    size_t budget_{0};
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+// Log-linear histogram of nanosecond latencies: every power of two is split into SUB_BUCKETS
+// linear steps, so a percentile is off by at most 1/SUB_BUCKETS of its value. Recording is a
+// few shifts and an increment on a fixed array, cheap enough for every request.
+class LatencyHistogram {
+    static constexpr int SUB_BITS = 3;
+    static constexpr uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr int BUCKET_NUM = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+public:
+    void Record(std::chrono::nanoseconds latency) {
+        uint64_t ns = latency.count() > 0 ? latency.count() : 0;
+        ++counts_[_Index(ns)];
+        ++count_;
+        max_ = std::max(max_, ns);
+    }
+
+    uint64_t Count() const { return count_; }
+
+    std::chrono::nanoseconds Max() const { return std::chrono::nanoseconds(max_); }
+
+    // Upper bound of the bucket holding quantile q (0 to 1), 0 when nothing was recorded.
+    std::chrono::nanoseconds Percentile(double q) const {
+        if(0 == count_) {
+            return std::chrono::nanoseconds(0);
+        }
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)(q * count_ + 0.5));
+        uint64_t seen = 0;
+        for(int i = 0; i < BUCKET_NUM; ++i) {
+            seen += counts_[i];
+            if(seen >= target) {
+                return std::chrono::nanoseconds(std::min(_Upper(i), max_));
+            }
+        }
+        return Max();
+    }
+
+    void Reset() {
+        std::fill(std::begin(counts_), std::end(counts_), 0);
+        count_ = 0;
+        max_   = 0;
+    }
+
+private:
+    static int _Index(uint64_t ns) {
+        if(ns < SUB_BUCKETS) {
+            return ns;
+        }
+        int shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((ns >> shift) - SUB_BUCKETS);
+    }
+
+    static uint64_t _Upper(int index) {
+        if(index < (int)SUB_BUCKETS) {
+            return index;
+        }
+        int shift = index / SUB_BUCKETS - 1;
+        uint64_t lower = (index % SUB_BUCKETS + SUB_BUCKETS) << shift;
+        return lower + (1ull << shift) - 1;
+    }
+
+private:
+    uint64_t counts_[BUCKET_NUM]{};
+    uint64_t count_{0};
+    uint64_t max_{0};
+};
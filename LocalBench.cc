@@ -0,0 +1,170 @@
+#include "LocalBench.h"
+#include "Logger.h"
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+// Ticks in a row without a single reply before the sessions count as stalled, an idle tick may
+// block for the selector's idleWait.
+const uint32_t LOCAL_BENCH_MAX_IDLE_TICKS = 1000;
+
+struct LocalClient {
+    int fd{-1};
+    uint32_t nextId{1};         // msgId of the next request to send
+    uint32_t expectId{1};       // msgId the next reply must carry
+    uint32_t inFlight{0};
+    std::string out;            // encoded requests the socket did not take yet
+    size_t outPos{0};
+    std::string in;             // reply bytes short of a whole frame
+};
+
+std::chrono::nanoseconds ThreadCpuTime() {
+    struct timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+// Writes what the socket takes, false once the server end is gone.
+bool Flush(LocalClient& client) {
+    while(client.outPos < client.out.size()) {
+        ssize_t ret = send(client.fd, client.out.data() + client.outPos, client.out.size() - client.outPos, MSG_NOSIGNAL);
+        if(ret < 0) {
+            if(EINTR == errno) {
+                continue;
+            }
+            if(EAGAIN == errno || EWOULDBLOCK == errno) {
+                break;
+            }
+            ERROR_LOG("local bench send fd[%d] failed, errno: %d, error: %s", client.fd, errno, strerror(errno));
+            return false;
+        }
+        client.outPos += ret;
+    }
+    if(client.outPos == client.out.size()) {
+        client.out.clear();
+        client.outPos = 0;
+    }
+    return true;
+}
+
+// Reads every reply that arrived, false on EOF, error or a reply out of order.
+bool Drain(LocalClient& client, MsgType type, LocalBenchResult& result) {
+    char buf[64 << 10];
+    while(true) {
+        ssize_t ret = recv(client.fd, buf, sizeof(buf), 0);
+        if(ret < 0) {
+            if(EINTR == errno) {
+                continue;
+            }
+            if(EAGAIN == errno || EWOULDBLOCK == errno) {
+                break;
+            }
+            ERROR_LOG("local bench recv fd[%d] failed, errno: %d, error: %s", client.fd, errno, strerror(errno));
+            return false;
+        }
+        if(0 == ret) {
+            ERROR_LOG("local bench fd[%d] closed by the server", client.fd);
+            return false;
+        }
+        client.in.append(buf, ret);
+    }
+
+    size_t pos = 0;
+    while(client.in.size() - pos >= sizeof(MsgHead)) {
+        MsgHead head;
+        memcpy(&head, client.in.data() + pos, sizeof(head));
+        if(client.in.size() - pos - sizeof(head) < head.dataLen) {
+            break;
+        }
+        if(head.msgId != client.expectId || head.type != type) {
+            ERROR_LOG("local bench fd[%d] got reply msgId[%u] type[%d], expected msgId[%u] type[%d]",
+                      client.fd, head.msgId, head.type, client.expectId, type);
+            return false;
+        }
+        // a reply body leads with its status byte
+        if(0 == head.dataLen || 1 != client.in[pos + sizeof(head)]) {
+            ++result.failed;
+        }
+        ++result.requests;
+        ++client.expectId;
+        --client.inFlight;
+        pos += sizeof(head) + head.dataLen;
+    }
+    client.in.erase(0, pos);
+    return true;
+}
+
+}
+
+bool RunLocalBench(AsyncServer& server, const LocalBenchConfig& config, LocalBenchResult& result) {
+    result = LocalBenchResult();
+    if(0 == config.connections || 0 == config.depth) {
+        ERROR_LOG("local bench needs at least one connection and one request in flight");
+        return false;
+    }
+
+    std::vector<LocalClient> clients(config.connections);
+    for(auto& client : clients) {
+        client.fd = server.ConnectLocal();
+        if(INVALID_SOCKET_VALUE == client.fd) {
+            for(auto& opened : clients) {
+                if(opened.fd >= 0) {
+                    close(opened.fd);
+                }
+            }
+            return false;
+        }
+    }
+
+    // one encoded request, only its msgId changes from send to send
+    std::string frame;
+    MsgHeadCodec::EncodeFrame(0, config.type, config.payload, 0, frame);
+
+    auto wallStart = std::chrono::steady_clock::now();
+    auto cpuStart = ThreadCpuTime();
+    uint64_t sent = 0;
+    uint32_t idleTicks = 0;
+    bool ok = true;
+    while(ok && result.requests < config.requests) {
+        for(auto& client : clients) {
+            while(client.inFlight < config.depth && sent < config.requests) {
+                size_t at = client.out.size();
+                client.out.append(frame);
+                memcpy(client.out.data() + at + offsetof(MsgHead, msgId), &client.nextId, sizeof(client.nextId));
+                ++client.nextId;
+                ++client.inFlight;
+                ++sent;
+            }
+            ok = ok && Flush(client);
+        }
+
+        server.RunOnce();
+        ++result.ticks;
+
+        uint64_t before = result.requests;
+        for(auto& client : clients) {
+            ok = ok && Drain(client, config.type, result);
+        }
+        idleTicks = result.requests == before ? idleTicks + 1 : 0;
+        if(idleTicks >= LOCAL_BENCH_MAX_IDLE_TICKS) {
+            ERROR_LOG("local bench stalled after %lu replies", (unsigned long)result.requests);
+            ok = false;
+        }
+    }
+    result.cpu  = ThreadCpuTime() - cpuStart;
+    result.wall = std::chrono::steady_clock::now() - wallStart;
+
+    // the sessions see EOF and end, one more tick reaps them
+    for(auto& client : clients) {
+        close(client.fd);
+    }
+    server.RunOnce();
+    server.RunOnce();
+    return ok;
+}
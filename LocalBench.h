@@ -0,0 +1,28 @@
+#pragma once
+
+#include "CoroutineServer.h"
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+struct LocalBenchConfig {
+    uint32_t connections{1};
+    uint32_t depth{1};              // requests in flight per connection
+    uint64_t requests{1000000};     // over all connections
+    MsgType type{MsgType::REQ};
+    std::string payload{"hello"};
+};
+
+struct LocalBenchResult {
+    uint64_t requests{0};           // replies received
+    uint64_t failed{0};             // of which with a false status
+    uint64_t ticks{0};              // reactor ticks it took
+    std::chrono::nanoseconds wall{0};
+    std::chrono::nanoseconds cpu{0};    // thread CPU time, the server's share and the driver's
+};
+
+// Pushes MsgHead requests through AsyncServer sessions over ConnectLocal socketpairs and steps the
+// reactor itself, all on the calling thread. There is no network and no second thread, so a run
+// does the same work every time and its CPU time per request is the server's own cost plus the
+// unix socket copies on both ends. False if a reply came out of order or the sessions stalled.
+bool RunLocalBench(AsyncServer& server, const LocalBenchConfig& config, LocalBenchResult& result);
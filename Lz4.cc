@@ -0,0 +1,210 @@
+#include "Lz4.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+const size_t MIN_MATCH     = 4;
+const size_t LAST_LITERALS = 5;     // the block must end with at least this many literals
+const size_t MF_LIMIT      = 12;    // no match may start closer than this to the end
+const size_t MAX_OFFSET    = 65535;
+const int    HASH_LOG      = 13;
+const int    SKIP_TRIGGER  = 6;
+
+inline uint32_t Read32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t Read64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// length of the common prefix of ref and ip, ip never reads at or past limit
+inline size_t CommonLength(const char* ref, const char* ip, const char* limit) {
+    const char* start = ip;
+    while(ip + sizeof(uint64_t) <= limit) {
+        uint64_t diff = Read64(ref) ^ Read64(ip);
+        if(diff) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return ip - start + (__builtin_ctzll(diff) >> 3);
+#else
+            return ip - start + (__builtin_clzll(diff) >> 3);
+#endif
+        }
+        ip += sizeof(uint64_t);
+        ref += sizeof(uint64_t);
+    }
+    while(ip < limit && *ref == *ip) {
+        ++ip;
+        ++ref;
+    }
+    return ip - start;
+}
+
+inline uint32_t Hash(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// writes the 255-run continuation of a length that did not fit in its token nibble
+inline bool PutLength(char*& op, const char* oend, size_t len) {
+    for(; len >= 255; len -= 255) {
+        if(op >= oend) {
+            return false;
+        }
+        *op++ = (char)255;
+    }
+    if(op >= oend) {
+        return false;
+    }
+    *op++ = (char)len;
+    return true;
+}
+
+inline bool PutSequence(char*& op, const char* oend, const char* literals, size_t litLen, size_t offset, size_t matchLen) {
+    if(op >= oend) {
+        return false;
+    }
+    char* token = op++;
+    uint8_t tok = 0;
+    if(litLen >= 15) {
+        tok = 15 << 4;
+        if(!PutLength(op, oend, litLen - 15)) {
+            return false;
+        }
+    } else {
+        tok = litLen << 4;
+    }
+    if((size_t)(oend - op) < litLen) {
+        return false;
+    }
+    memcpy(op, literals, litLen);
+    op += litLen;
+
+    if(0 == matchLen) {
+        *token = tok;
+        return true;
+    }
+    if(oend - op < 2) {
+        return false;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    size_t ml = matchLen - MIN_MATCH;
+    if(ml >= 15) {
+        tok |= 15;
+        if(!PutLength(op, oend, ml - 15)) {
+            return false;
+        }
+    } else {
+        tok |= ml;
+    }
+    *token = tok;
+    return true;
+}
+
+inline bool GetLength(const uint8_t*& ip, const uint8_t* iend, size_t& len) {
+    uint8_t b;
+    do {
+        if(ip >= iend) {
+            return false;
+        }
+        b = *ip++;
+        len += b;
+    } while(255 == b);
+    return true;
+}
+
+}
+
+size_t Lz4Compress(const char* src, size_t srcLen, char* dst, size_t dstCap) {
+    char* op = dst;
+    const char* oend = dst + dstCap;
+    size_t anchor = 0;
+
+    if(srcLen > MF_LIMIT) {
+        uint32_t table[1 << HASH_LOG];
+        memset(table, 0, sizeof(table));
+        size_t limit = srcLen - MF_LIMIT;
+        size_t ip = 1;
+        // like upstream lz4 the probe stride grows with consecutive misses, so data that
+        // does not compress is skipped over quickly instead of hashed byte by byte
+        size_t misses = 1 << SKIP_TRIGGER;
+        while(ip < limit) {
+            uint32_t seq = Read32(src + ip);
+            uint32_t h = Hash(seq);
+            size_t ref = table[h];
+            table[h] = ip;
+            // position 0 doubles as the empty marker, it is never a match candidate
+            if(0 == ref || ip - ref > MAX_OFFSET || Read32(src + ref) != seq) {
+                ip += misses++ >> SKIP_TRIGGER;
+                continue;
+            }
+            misses = 1 << SKIP_TRIGGER;
+
+            size_t matchLen = MIN_MATCH + CommonLength(src + ref + MIN_MATCH, src + ip + MIN_MATCH, src + srcLen - LAST_LITERALS);
+            if(!PutSequence(op, oend, src + anchor, ip - anchor, ip - ref, matchLen)) {
+                return 0;
+            }
+            ip += matchLen;
+            anchor = ip;
+        }
+    }
+
+    if(!PutSequence(op, oend, src + anchor, srcLen - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - dst;
+}
+
+int64_t Lz4Decompress(const char* src, size_t srcLen, char* dst, size_t dstCap) {
+    auto ip = (const uint8_t*)src;
+    auto iend = ip + srcLen;
+    char* op = dst;
+    char* oend = dst + dstCap;
+
+    while(ip < iend) {
+        uint8_t token = *ip++;
+        size_t litLen = token >> 4;
+        if(15 == litLen && !GetLength(ip, iend, litLen)) {
+            return -1;
+        }
+        if((size_t)(iend - ip) < litLen || (size_t)(oend - op) < litLen) {
+            return -1;
+        }
+        memcpy(op, ip, litLen);
+        ip += litLen;
+        op += litLen;
+        if(ip == iend) {
+            // the last sequence has literals only
+            break;
+        }
+
+        if(iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t matchLen = token & 15;
+        if(15 == matchLen && !GetLength(ip, iend, matchLen)) {
+            return -1;
+        }
+        matchLen += MIN_MATCH;
+        if(0 == offset || offset > (size_t)(op - dst) || (size_t)(oend - op) < matchLen) {
+            return -1;
+        }
+
+        // an overlapping match repeats the last offset bytes, copy it a period at a time
+        const char* match = op - offset;
+        while(matchLen > 0) {
+            size_t step = std::min(matchLen, offset);
+            memcpy(op, match, step);
+            op += step;
+            matchLen -= step;
+        }
+    }
+    return op - dst;
+}
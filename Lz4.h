@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// LZ4 block format (no frame header): greedy single-probe matcher for speed,
+// output is readable by any LZ4 block decoder and vice versa.
+
+// Worst case output size for len input bytes.
+inline size_t Lz4CompressBound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+// Returns the compressed size, or 0 if it does not fit in dstCap.
+size_t Lz4Compress(const char* src, size_t srcLen, char* dst, size_t dstCap);
+
+// Returns the decompressed size, or -1 on malformed input or when it would exceed dstCap.
+int64_t Lz4Decompress(const char* src, size_t srcLen, char* dst, size_t dstCap);
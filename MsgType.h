@@ -4,7 +4,48 @@
 enum MsgType {
     MSG = 1,
     REQ = 2,
-    UNKNOWN = 3
+    UNKNOWN = 3,
+    BLOB = 4,
+    UPLOAD = 5,         // body is streamed to the handler instead of buffered
+    STREAM_CHUNK = 6,   // one part of a chunked response, carries the request msgId
+    STREAM_END = 7,     // last frame of a chunked response
+    LIST = 8,           // blob names matching the payload prefix, streamed in batches
+    GET = 9,            // key -> found flag + value
+    SET = 10,           // u32 key len, key, value -> stored flag
+    DEL = 11,           // key -> deleted flag
+    MGET = 12,          // repeated (u32 key len, key) -> true + repeated (i32 value len or -1, value)
+    HELLO = 13,         // u32 wanted MsgCap bits -> true + u32 granted bits
+    BATCH = 14,         // repeated (MsgHead, body) -> true + repeated (MsgHead, reply body), in order
+    SUBSCRIBE = 15,     // topic -> true, MESSAGE frames for the topic follow until UNSUBSCRIBE
+    UNSUBSCRIBE = 16,   // topic -> subscribed flag
+    PUBLISH = 17,       // u32 topic len, topic, payload -> true + u32 subscribers it was queued for
+    MESSAGE = 18        // pushed with msgId 0, same body as the PUBLISH that sent it
+};
+
+// Per-connection options agreed with HELLO. They apply to the frames the client sends after it.
+enum MsgCap : uint32_t {
+    CAP_CRC32C = 1 << 0,    // a u32 CRC-32C over MsgHead, MsgHeadExt and body follows MsgHead
+    CAP_LZ4    = 1 << 1,    // frames in both directions may carry an LZ4 block compressed body
+    CAP_DEADLINE = 1 << 2   // requests may carry a timeout in their MsgHeadExt
+};
+
+// Set in MsgHead::type when a MsgHeadExt follows MsgHead (after the CRC when there is one).
+// dataLen then counts the body as sent, the extension and the CRC are not part of it.
+const uint32_t MSG_EXT_FLAG = 0x80000000u;
+const uint8_t  MSG_EXT_VERSION = 2;
+const uint16_t MSG_EXT_V1_LEN  = 8;         // version 1 ends after rawLen, the server replies with it
+
+enum MsgExtFlag : uint8_t {
+    EXT_LZ4      = 1 << 0,  // body is one LZ4 block of rawLen bytes
+    EXT_DEADLINE = 1 << 1   // skip the request unless it starts within timeoutUs of its header arriving
+};
+
+struct MsgHeadExt {
+    uint8_t  version;       // 1 or 2, unknown versions drop the connection
+    uint8_t  flags;         // MsgExtFlag bits
+    uint16_t extLen;        // MSG_EXT_V1_LEN for version 1, sizeof(MsgHeadExt) for version 2
+    uint32_t rawLen;        // body length before compression
+    uint32_t timeoutUs;     // version 2
 };
 
 typedef struct MsgHead {
@@ -0,0 +1,61 @@
+#include "PubSub.h"
+#include <algorithm>
+
+bool PubSub::_Erase(std::vector<int>& fds, int fd) {
+    auto itr = std::find(fds.begin(), fds.end(), fd);
+    if(itr == fds.end()) {
+        return false;
+    }
+    // delivery order between subscribers does not matter
+    *itr = fds.back();
+    fds.pop_back();
+    return true;
+}
+
+bool PubSub::Subscribe(int fd, const std::string& topic) {
+    auto& topics = mapFd2Topics_[fd];
+    if(std::find(topics.begin(), topics.end(), topic) != topics.end()) {
+        return false;
+    }
+    topics.push_back(topic);
+    mapTopic2Fds_[topic].push_back(fd);
+    return true;
+}
+
+bool PubSub::Unsubscribe(int fd, const std::string& topic) {
+    auto itr = mapFd2Topics_.find(fd);
+    if(itr == mapFd2Topics_.end()) {
+        return false;
+    }
+    auto& topics = itr->second;
+    auto pos = std::find(topics.begin(), topics.end(), topic);
+    if(pos == topics.end()) {
+        return false;
+    }
+    topics.erase(pos);
+
+    auto fds = mapTopic2Fds_.find(topic);
+    if(fds != mapTopic2Fds_.end() && _Erase(fds->second, fd) && fds->second.empty()) {
+        mapTopic2Fds_.erase(fds);
+    }
+    return true;
+}
+
+void PubSub::RemoveFd(int fd) {
+    auto itr = mapFd2Topics_.find(fd);
+    if(itr == mapFd2Topics_.end()) {
+        return;
+    }
+    for(auto& topic : itr->second) {
+        auto fds = mapTopic2Fds_.find(topic);
+        if(fds != mapTopic2Fds_.end() && _Erase(fds->second, fd) && fds->second.empty()) {
+            mapTopic2Fds_.erase(fds);
+        }
+    }
+    mapFd2Topics_.erase(itr);
+}
+
+const std::vector<int>* PubSub::Subscribers(const std::string& topic) const {
+    auto itr = mapTopic2Fds_.find(topic);
+    return itr == mapTopic2Fds_.end() ? nullptr : &itr->second;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Topic table of the pub/sub message types: which connections subscribed to which
+// topics. Fan-out walks a flat fd vector per topic; each connection also keeps its
+// own topics so closing it does not have to scan the table.
+class PubSub {
+public:
+    // False if fd already subscribed to topic.
+    bool Subscribe(int fd, const std::string& topic);
+
+    // False if fd was not subscribed to topic.
+    bool Unsubscribe(int fd, const std::string& topic);
+
+    void RemoveFd(int fd);
+
+    // nullptr when nobody subscribed to topic.
+    const std::vector<int>* Subscribers(const std::string& topic) const;
+
+    size_t Topics() const { return mapTopic2Fds_.size(); }
+
+private:
+    static bool _Erase(std::vector<int>& fds, int fd);
+
+private:
+    std::unordered_map<std::string, std::vector<int>> mapTopic2Fds_;
+
+    std::unordered_map<int, std::vector<std::string>> mapFd2Topics_;
+};
@@ -0,0 +1,184 @@
+#include "RateLimiter.h"
+#include "Logger.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <netinet/in.h>
+
+namespace {
+
+RateLimit WithBurst(RateLimit limit) {
+    if(0 == limit.reqBurst) {
+        limit.reqBurst = limit.reqPerSec;
+    }
+    if(0 == limit.bytesBurst) {
+        limit.bytesBurst = limit.bytesPerSec;
+    }
+    return limit;
+}
+
+}
+
+RateLimiter::RateLimiter(const RateLimit& perIp, const RateLimit& perConn, uint32_t maxConnPerIp, uint32_t ipSlots)
+    : perIp_(WithBurst(perIp)), perConn_(WithBurst(perConn)), maxConnPerIp_(maxConnPerIp) {
+    uint32_t slots = MAX_PROBE;
+    while(slots < ipSlots) {
+        slots <<= 1;
+    }
+    mask_ = slots - 1;
+    ipSlots_.reset(new IpSlot[slots]);
+    INFO_LOG("rate limiter per ip[%u req/s, %lu B/s] per conn[%u req/s, %lu B/s] max conn per ip[%u] slots[%u]",
+            perIp_.reqPerSec, perIp_.bytesPerSec, perConn_.reqPerSec, perConn_.bytesPerSec, maxConnPerIp_, slots);
+}
+
+bool RateLimiter::_IpKey(const struct sockaddr_storage& peer, uint8_t (&addr)[16]) {
+    if(AF_INET == peer.ss_family) {
+        auto in = (const struct sockaddr_in*)&peer;
+        memset(addr, 0, 10);
+        addr[10] = addr[11] = 0xff;
+        memcpy(addr + 12, &in->sin_addr, 4);
+        return true;
+    } else if(AF_INET6 == peer.ss_family) {
+        auto in6 = (const struct sockaddr_in6*)&peer;
+        memcpy(addr, &in6->sin6_addr, 16);
+        return true;
+    }
+    return false;
+}
+
+uint64_t RateLimiter::_Hash(const uint8_t (&addr)[16]) {
+    uint64_t lo, hi;
+    memcpy(&lo, addr, 8);
+    memcpy(&hi, addr + 8, 8);
+    uint64_t hash = (lo ^ (hi * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+    return hash ^ (hash >> 32);
+}
+
+int64_t RateLimiter::_NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void RateLimiter::_Refill(const RateLimit& limit, Bucket& bucket, int64_t now) const {
+    double elapsed = (now - bucket.lastNs) / 1e9;
+    bucket.lastNs = now;
+    if(limit.reqPerSec) {
+        bucket.reqs = std::min<double>(limit.reqBurst, bucket.reqs + limit.reqPerSec * elapsed);
+    }
+    if(limit.bytesPerSec) {
+        bucket.bytes = std::min<double>(limit.bytesBurst, bucket.bytes + limit.bytesPerSec * elapsed);
+    }
+}
+
+double RateLimiter::_DebtSeconds(const RateLimit& limit, const Bucket& bucket) {
+    double seconds = 0;
+    if(limit.reqPerSec && bucket.reqs < 0) {
+        seconds = -bucket.reqs / limit.reqPerSec;
+    }
+    if(limit.bytesPerSec && bucket.bytes < 0) {
+        seconds = std::max(seconds, -bucket.bytes / limit.bytesPerSec);
+    }
+    return seconds;
+}
+
+bool RateLimiter::_Full(const RateLimit& limit, const Bucket& bucket) const {
+    return (!limit.reqPerSec || bucket.reqs >= limit.reqBurst) && (!limit.bytesPerSec || bucket.bytes >= limit.bytesBurst);
+}
+
+int32_t RateLimiter::_FindIp(const uint8_t (&addr)[16], int64_t now) {
+    uint32_t start = _Hash(addr) & mask_;
+    for(uint32_t probe = 0; probe < MAX_PROBE; ++probe) {
+        IpSlot& slot = ipSlots_[(start + probe) & mask_];
+        if(slot.used && 0 == memcmp(slot.addr, addr, sizeof(slot.addr))) {
+            return (start + probe) & mask_;
+        }
+    }
+
+    // slots stay in place once used so probe chains never break; a source without
+    // connections whose buckets refilled carries no state and can be overwritten
+    for(uint32_t probe = 0; probe < MAX_PROBE; ++probe) {
+        IpSlot& slot = ipSlots_[(start + probe) & mask_];
+        if(slot.used) {
+            if(slot.conns > 0) {
+                continue;
+            }
+            _Refill(perIp_, slot.bucket, now);
+            if(!_Full(perIp_, slot.bucket)) {
+                continue;
+            }
+        }
+        memcpy(slot.addr, addr, sizeof(slot.addr));
+        slot.used   = true;
+        slot.conns  = 0;
+        slot.bucket = Bucket{(double)perIp_.reqBurst, (double)perIp_.bytesBurst, now};
+        return (start + probe) & mask_;
+    }
+    return -1;
+}
+
+bool RateLimiter::Admit(int fd, const struct sockaddr_storage& peer) {
+    if(fd < 0) {
+        return false;
+    }
+    int64_t now = _NowNs();
+    int32_t ipSlot = -1;
+    uint8_t addr[16];
+    if(_IpKey(peer, addr)) {
+        ipSlot = _FindIp(addr, now);
+        if(ipSlot < 0) {
+            WARN_LOG("rate limiter has no free slot for a new source, raise ipSlots");
+            ++rejected_;
+            return false;
+        }
+        IpSlot& slot = ipSlots_[ipSlot];
+        _Refill(perIp_, slot.bucket, now);
+        if((maxConnPerIp_ && slot.conns >= maxConnPerIp_) || (perIp_.reqPerSec && slot.bucket.reqs < 1)) {
+            ++rejected_;
+            return false;
+        }
+        if(perIp_.reqPerSec) {
+            slot.bucket.reqs -= 1;
+        }
+        ++slot.conns;
+    }
+
+    if((size_t)fd >= conns_.size()) {
+        conns_.resize(fd + 1);
+    }
+    conns_[fd] = ConnSlot{Bucket{(double)perConn_.reqBurst, (double)perConn_.bytesBurst, now}, ipSlot, true};
+    return true;
+}
+
+std::chrono::microseconds RateLimiter::Charge(int fd, uint32_t reqs, uint64_t bytes) {
+    if(fd < 0 || (size_t)fd >= conns_.size() || !conns_[fd].active) {
+        return std::chrono::microseconds(0);
+    }
+    int64_t now = _NowNs();
+    auto charge = [now, reqs, bytes, this](const RateLimit& limit, Bucket& bucket) {
+        _Refill(limit, bucket, now);
+        bucket.reqs  -= limit.reqPerSec ? reqs : 0;
+        bucket.bytes -= limit.bytesPerSec ? bytes : 0;
+        return _DebtSeconds(limit, bucket);
+    };
+
+    ConnSlot& conn = conns_[fd];
+    double seconds = charge(perConn_, conn.bucket);
+    if(conn.ipSlot >= 0) {
+        seconds = std::max(seconds, charge(perIp_, ipSlots_[conn.ipSlot].bucket));
+    }
+    if(seconds <= 0) {
+        return std::chrono::microseconds(0);
+    }
+    ++throttled_;
+    return std::chrono::microseconds((int64_t)std::ceil(seconds * 1e6));
+}
+
+void RateLimiter::Release(int fd) {
+    if(fd < 0 || (size_t)fd >= conns_.size() || !conns_[fd].active) {
+        return;
+    }
+    ConnSlot& conn = conns_[fd];
+    if(conn.ipSlot >= 0 && ipSlots_[conn.ipSlot].conns > 0) {
+        --ipSlots_[conn.ipSlot].conns;
+    }
+    conn.active = false;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <sys/socket.h>
+#include <vector>
+
+// Rate and burst of one token bucket. A zero rate leaves that dimension unlimited,
+// a zero burst allows one second worth of the rate.
+struct RateLimit {
+    uint32_t reqPerSec{0};
+    uint32_t reqBurst{0};
+    uint64_t bytesPerSec{0};
+    uint64_t bytesBurst{0};
+};
+
+// Request and byte token buckets per source address and per connection. Buckets may
+// run into debt: a request is always served once read, and its cost decides how long
+// the connection waits before the next read. Source addresses live in a fixed open
+// addressed table of one cache line per slot, connections in a vector indexed by fd.
+class RateLimiter {
+    static constexpr uint32_t MAX_PROBE = 8;
+public:
+    RateLimiter(const RateLimit& perIp, const RateLimit& perConn, uint32_t maxConnPerIp, uint32_t ipSlots = 4096);
+
+    // Called on accept. False if the source is over its connection limit or out of
+    // request tokens; an accepted connection costs its source one request token.
+    bool Admit(int fd, const struct sockaddr_storage& peer);
+
+    // Charges reqs and bytes to fd and its source. Returns how long to hold off reading, 0 if not at all.
+    std::chrono::microseconds Charge(int fd, uint32_t reqs, uint64_t bytes);
+
+    void Release(int fd);
+
+    uint64_t Rejected() const { return rejected_; }
+
+    uint64_t Throttled() const { return throttled_; }
+
+private:
+    struct Bucket {
+        double reqs{0};
+        double bytes{0};
+        int64_t lastNs{0};
+    };
+
+    struct alignas(64) IpSlot {
+        uint8_t addr[16];       // v4 sources are stored v4-mapped, so both families share a slot
+        uint32_t conns{0};
+        bool used{false};
+        Bucket bucket;
+    };
+
+    struct ConnSlot {
+        Bucket bucket;
+        int32_t ipSlot{-1};     // -1 for unix peers, they are only limited per connection
+        bool active{false};
+    };
+
+    static bool _IpKey(const struct sockaddr_storage& peer, uint8_t (&addr)[16]);
+
+    static uint64_t _Hash(const uint8_t (&addr)[16]);
+
+    static int64_t _NowNs();
+
+    void _Refill(const RateLimit& limit, Bucket& bucket, int64_t now) const;
+
+    // Time until the bucket is out of debt, 0 when it already is.
+    static double _DebtSeconds(const RateLimit& limit, const Bucket& bucket);
+
+    bool _Full(const RateLimit& limit, const Bucket& bucket) const;
+
+    int32_t _FindIp(const uint8_t (&addr)[16], int64_t now);
+
+private:
+    RateLimit perIp_;
+
+    RateLimit perConn_;
+
+    uint32_t maxConnPerIp_;
+
+    uint32_t mask_;
+
+    std::unique_ptr<IpSlot[]> ipSlots_;
+
+    std::vector<ConnSlot> conns_;
+
+    uint64_t rejected_{0};
+
+    uint64_t throttled_{0};
+};
@@ -1,10 +1,23 @@
 #include "RequestHandler.h"
+#include "CoroutineServer.h"
+#include "KvStore.h"
 #include "Logger.h"
 #include <sstream>
+#include <charconv>
 #include <cstring>
+#include <memory>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 std::atomic<uint32_t> RequestHandler::_requestNum{0};
 
+std::string RequestHandler::_blobRoot;
+
+void RequestHandler::SetBlobRoot(const std::string& root) {
+    _blobRoot = root;
+}
+
 void RequestHandler::HandleRequest(MsgType type, std::string& reqMsg, std::string& respMsg) {
     ++_requestNum;
     switch (type) {
@@ -14,45 +27,338 @@ void RequestHandler::HandleRequest(MsgType type, std::string& reqMsg, std::strin
         case MsgType::REQ:
             _HandleRequest(reqMsg, respMsg);
             break;
+        case MsgType::GET:
+            _HandleGet(reqMsg, respMsg);
+            break;
+        case MsgType::SET:
+            _HandleSet(reqMsg, respMsg);
+            break;
+        case MsgType::DEL:
+            _HandleDel(reqMsg, respMsg);
+            break;
+        case MsgType::MGET:
+            _HandleMGet(reqMsg, respMsg);
+            break;
+        case MsgType::BATCH:
+            _HandleBatch(reqMsg, respMsg);
+            break;
+        case MsgType::BLOB: {
+            // no zero-copy path for this caller, read the blob into the reply
+            ResponseBody body;
+            _HandleBlob(reqMsg, respMsg, body);
+            if(ResponseBody::FILE_REGION == body.kind) {
+                size_t inlineLen = respMsg.length();
+                respMsg.resize(inlineLen + body.len);
+                auto len = pread(body.fd, respMsg.data() + inlineLen, body.len, body.offset);
+                if(len != (ssize_t)body.len) {
+                    ERROR_LOG("read blob failed, len: %ld, errno: %d, error: %s", (long)len, errno, strerror(errno));
+                    _MakeErrResponse(respMsg);
+                }
+            }
+            break;
+        }
         default:
             _MakeErrResponse(respMsg);
             break;
     }
 }
 
+void RequestHandler::HandleRequest(MsgType type, std::string& reqMsg, std::string& respMsg, ResponseBody& body) {
+    if(MsgType::BLOB != type) {
+        HandleRequest(type, reqMsg, respMsg);
+        return;
+    }
+
+    ++_requestNum;
+    _HandleBlob(reqMsg, respMsg, body);
+}
+
+// Both replies are written straight into respMsg, which keeps its capacity from the last request.
 void RequestHandler::_HandleMsg(std::string& reqMsg, std::string& respMsg) {
-    std::stringstream ss;
-    ss << "receive msg, msg: " << reqMsg << ", and its confirm response";
-    auto response = ss.str();
+    respMsg.assign(sizeof(bool), '\1');
+    respMsg.append("receive msg, msg: ").append(reqMsg).append(", and its confirm response");
+    INFO_LOG("%s\n", respMsg.c_str() + sizeof(bool));
+}
+
+void RequestHandler::_HandleRequest(std::string& reqMsg, std::string& respMsg) {
+    char num[16];
+    auto numEnd = std::to_chars(num, num + sizeof(num), _requestNum.load()).ptr;
+    respMsg.assign(sizeof(bool), '\1');
+    respMsg.append("receive request, reqMsg: ").append(reqMsg).append(", the request num is: ").append(num, numEnd);
+    INFO_LOG("%s\n", respMsg.c_str() + sizeof(bool));
+}
 
-    uint32_t respLen = sizeof(bool) + response.length();
-    respMsg.resize(respLen);
+void RequestHandler::_HandleGet(std::string& reqMsg, std::string& respMsg) {
+    respMsg.assign(sizeof(bool), '\0');
+    *(bool *)respMsg.data() = KvStore::Instance()->AppendValue(reqMsg, respMsg);
+}
+
+void RequestHandler::_HandleSet(std::string& reqMsg, std::string& respMsg) {
+    respMsg.assign(sizeof(bool), '\0');
+    uint32_t keyLen = 0;
+    if(reqMsg.length() < sizeof(keyLen)) {
+        return;
+    }
+    memcpy(&keyLen, reqMsg.data(), sizeof(keyLen));
+    if(reqMsg.length() - sizeof(keyLen) < keyLen) {
+        WARN_LOG("kv set key len[%u] exceeds request len[%lu]", keyLen, reqMsg.length());
+        return;
+    }
+
+    std::string_view key(reqMsg.data() + sizeof(keyLen), keyLen);
+    std::string_view value(reqMsg.data() + sizeof(keyLen) + keyLen, reqMsg.length() - sizeof(keyLen) - keyLen);
+    *(bool *)respMsg.data() = KvStore::Instance()->Set(key, value);
+}
+
+void RequestHandler::_HandleDel(std::string& reqMsg, std::string& respMsg) {
+    respMsg.assign(sizeof(bool), '\0');
+    *(bool *)respMsg.data() = KvStore::Instance()->Del(reqMsg);
+}
+
+void RequestHandler::_HandleMGet(std::string& reqMsg, std::string& respMsg) {
+    respMsg.assign(sizeof(bool), '\0');
+    size_t pos = 0;
+    while(pos < reqMsg.length()) {
+        uint32_t keyLen = 0;
+        if(reqMsg.length() - pos < sizeof(keyLen)) {
+            return;
+        }
+        memcpy(&keyLen, reqMsg.data() + pos, sizeof(keyLen));
+        pos += sizeof(keyLen);
+        if(reqMsg.length() - pos < keyLen) {
+            WARN_LOG("kv mget key len[%u] exceeds request len[%lu]", keyLen, reqMsg.length());
+            respMsg.assign(sizeof(bool), '\0');
+            return;
+        }
+
+        // reserve the length field, then let the store append the value behind it
+        size_t lenPos = respMsg.length();
+        respMsg.resize(lenPos + sizeof(int32_t));
+        int32_t valLen = -1;
+        if(KvStore::Instance()->AppendValue(std::string_view(reqMsg.data() + pos, keyLen), respMsg)) {
+            valLen = respMsg.length() - lenPos - sizeof(int32_t);
+        }
+        memcpy(respMsg.data() + lenPos, &valLen, sizeof(valLen));
+        pos += keyLen;
+    }
     *(bool *)respMsg.data() = true;
-    memcpy(respMsg.data() + sizeof(bool), response.data(), response.length());
-    INFO_LOG("%s\n", response.c_str());
 }
 
-void RequestHandler::_HandleRequest(std::string& reqMsg, std::string& respMsg) {
-    std::stringstream ss;
-    ss << "receive request, reqMsg: " << reqMsg << ", the request num is: " << _requestNum.load();
-    auto response = ss.str();
+bool RequestHandler::SplitBatch(const std::string& reqMsg, std::vector<std::pair<MsgHead, std::string_view>>& subs) {
+    subs.clear();
+    size_t pos = 0;
+    while(pos < reqMsg.length()) {
+        MsgHead head;
+        if(reqMsg.length() - pos < sizeof(MsgHead)) {
+            return false;
+        }
+        memcpy(&head, reqMsg.data() + pos, sizeof(MsgHead));
+        pos += sizeof(MsgHead);
+        if(reqMsg.length() - pos < head.dataLen) {
+            return false;
+        }
+        subs.emplace_back(head, std::string_view(reqMsg.data() + pos, head.dataLen));
+        pos += head.dataLen;
+    }
+    return true;
+}
 
-    uint32_t respLen = sizeof(bool) + response.length();
-    respMsg.resize(respLen);
+void RequestHandler::_HandleBatch(std::string& reqMsg, std::string& respMsg) {
+    std::vector<std::pair<MsgHead, std::string_view>> subs;
+    if(!SplitBatch(reqMsg, subs)) {
+        WARN_LOG("malformed batch, len[%lu]", reqMsg.length());
+        _MakeErrResponse(respMsg);
+        return;
+    }
+
+    // one reply frame for the whole batch, the sub buffers are reused across the loop
+    respMsg.assign(sizeof(bool), '\1');
+    std::string subReq;
+    std::string subResp;
+    for(auto& sub : subs) {
+        MsgHead head = sub.first;
+        subReq.assign(sub.second);
+        subResp.clear();
+        if(MsgType::BATCH == head.type) {
+            _MakeErrResponse(subResp);
+        } else {
+            HandleRequest(head.type, subReq, subResp);
+        }
+        head.dataLen = subResp.length();
+        respMsg.append((const char*)&head, sizeof(head));
+        respMsg.append(subResp);
+    }
+    INFO_LOG("handle batch of %lu messages, reply len[%lu]", subs.size(), respMsg.length());
+}
+
+void RequestHandler::_HandleBlob(std::string& reqMsg, std::string& respMsg, ResponseBody& body) {
+    size_t size = 0;
+    int fd = _OpenBlob(reqMsg, size);
+    if(-1 == fd) {
+        _MakeErrResponse(respMsg);
+        return;
+    }
+
+    respMsg.resize(sizeof(bool));
     *(bool *)respMsg.data() = true;
-    memcpy(respMsg.data() + sizeof(bool), response.data(), response.length());
-    INFO_LOG("%s\n", response.c_str());
+    body.Reset();
+    body.kind = ResponseBody::FILE_REGION;
+    body.fd   = fd;
+    body.len  = size;
+    INFO_LOG("serve blob[%s] size[%lu]", reqMsg.c_str(), size);
+}
+
+Task<void> RequestHandler::HandleUpload(BodyReader& body, ChunkWriter& writer) {
+    ++_requestNum;
+    std::string name;
+    std::string tmpPath;
+    int fd = -1;
+    bool ok = true;
+    uint64_t written = 0;
+    uint64_t nextReport = UPLOAD_PROGRESS_STEP;
+    std::string_view chunk;
+    while(ok && co_await body.Next(chunk)) {
+        if(-1 == fd) {
+            auto pos = chunk.find('\0');
+            name.append(chunk.substr(0, pos));
+            if(name.length() > MAX_BLOB_NAME) {
+                ok = false;
+                break;
+            }
+            if(std::string_view::npos == pos) {
+                continue;
+            }
+            chunk.remove_prefix(pos + 1);
+
+            if(!_ValidBlobName(name)) {
+                ok = false;
+                break;
+            }
+            tmpPath = _blobRoot + "/." + name + ".upload";
+            fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if(-1 == fd) {
+                ERROR_LOG("create upload[%s] failed, errno: %d, error: %s", tmpPath.c_str(), errno, strerror(errno));
+                ok = false;
+                break;
+            }
+        }
+
+        while(!chunk.empty()) {
+            auto len = write(fd, chunk.data(), chunk.length());
+            if(len < 0 && EINTR == errno) {
+                continue;
+            }
+            if(len <= 0) {
+                ERROR_LOG("write upload[%s] failed, errno: %d, error: %s", tmpPath.c_str(), errno, strerror(errno));
+                ok = false;
+                break;
+            }
+            chunk.remove_prefix(len);
+            written += len;
+        }
+
+        if(ok && written >= nextReport) {
+            nextReport += UPLOAD_PROGRESS_STEP;
+            std::string progress;
+            _MakeStatus(true, "received " + std::to_string(written) + " bytes", progress);
+            if(!co_await writer.Write(progress)) {
+                ok = false;
+            }
+        }
+    }
+
+    ok = ok && -1 != fd && !body.Failed() && 0 == body.Remaining();
+    if(-1 != fd) {
+        close(fd);
+        if(ok && -1 == rename(tmpPath.c_str(), (_blobRoot + "/" + name).c_str())) {
+            ERROR_LOG("rename upload[%s] failed, errno: %d, error: %s", tmpPath.c_str(), errno, strerror(errno));
+            ok = false;
+        }
+        if(!ok) {
+            unlink(tmpPath.c_str());
+        }
+    }
+
+    std::string result;
+    if(ok) {
+        _MakeStatus(true, "stored blob " + name + ", " + std::to_string(written) + " bytes", result);
+    } else {
+        _MakeStatus(false, "upload failed", result);
+    }
+    INFO_LOG("%s", result.c_str() + sizeof(bool));
+    co_await writer.End(result);
 }
 
+AsyncGenerator<std::string> RequestHandler::HandleList(std::string prefix) {
+    ++_requestNum;
+    if(_blobRoot.empty()) {
+        co_return;
+    }
+
+    // the consumer may drop the generator mid-listing, so the DIR must not outlive the frame
+    std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(_blobRoot.c_str()), closedir);
+    if(!dir) {
+        WARN_LOG("open blob root[%s] failed, errno: %d, error: %s", _blobRoot.c_str(), errno, strerror(errno));
+        co_return;
+    }
+
+    std::string batch(sizeof(bool), '\1');
+    while(auto entry = readdir(dir.get())) {
+        std::string_view name(entry->d_name);
+        if(name.empty() || name[0] == '.' || name.substr(0, prefix.length()) != prefix) {
+            continue;
+        }
+        batch.append(name).push_back('\n');
+        if(batch.length() >= LIST_BATCH_BYTES) {
+            co_yield std::move(batch);
+            batch.assign(sizeof(bool), '\1');
+        }
+    }
+    if(batch.length() > sizeof(bool)) {
+        co_yield std::move(batch);
+    }
+}
+
+bool RequestHandler::_ValidBlobName(const std::string& name) {
+    if(_blobRoot.empty() || name.empty() || name.length() > MAX_BLOB_NAME || name[0] == '.'
+        || name.find('/') != std::string::npos || name.find('\0') != std::string::npos) {
+        WARN_LOG("reject blob name[%s], blob root[%s]", name.c_str(), _blobRoot.c_str());
+        return false;
+    }
+    return true;
+}
+
+void RequestHandler::_MakeStatus(bool ok, const std::string& text, std::string& respMsg) {
+    respMsg.resize(sizeof(bool) + text.length());
+    *(bool *)respMsg.data() = ok;
+    memcpy(respMsg.data() + sizeof(bool), text.data(), text.length());
+}
+
+int RequestHandler::_OpenBlob(const std::string& name, size_t& size) {
+    if(!_ValidBlobName(name)) {
+        return -1;
+    }
+
+    std::string path = _blobRoot + "/" + name;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(-1 == fd) {
+        WARN_LOG("open blob[%s] failed, errno: %d, error: %s", path.c_str(), errno, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if(-1 == fstat(fd, &st) || !S_ISREG(st.st_mode) || (uint64_t)st.st_size >= UINT32_MAX - sizeof(bool)) {
+        WARN_LOG("blob[%s] is not a regular file or too large for a frame", path.c_str());
+        close(fd);
+        return -1;
+    }
+
+    size = st.st_size;
+    return fd;
+}
 
 void RequestHandler::_MakeErrResponse(std::string& respMsg) {
-    std::stringstream ss;
-    ss << "receive unknown request, failed handle request";
-    auto response = ss.str();
-
-    uint32_t respLen = sizeof(bool) + response.length();
-    respMsg.resize(respLen);
-    *(bool *)respMsg.data() = false;
-    memcpy(respMsg.data() + sizeof(bool), response.data(), response.length());
-    INFO_LOG("%s\n", response.c_str());
+    respMsg.assign(sizeof(bool), '\0');
+    respMsg.append("receive unknown request, failed handle request");
+    INFO_LOG("%s\n", respMsg.c_str() + sizeof(bool));
 }
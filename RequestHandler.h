@@ -1,10 +1,21 @@
 #pragma once
 
 #include "MsgType.h"
+#include "Response.h"
 #include <string>
+#include <string_view>
 #include <atomic>
+#include <vector>
+
+template <typename T> class Task;
+template <typename T> class AsyncGenerator;
+class BodyReader;
+class ChunkWriter;
 
 class RequestHandler {
+    static constexpr uint32_t MAX_BLOB_NAME = 255;
+    static constexpr uint64_t UPLOAD_PROGRESS_STEP = 16 << 20;
+    static constexpr uint32_t LIST_BATCH_BYTES = 64 << 10;
 public:
     RequestHandler() = default;
 
@@ -12,13 +23,49 @@ public:
 
     void HandleRequest(MsgType type, std::string& reqMsg, std::string& respMsg);
 
+    // Same as above, but a BLOB reply leaves the file in body instead of copying it into respMsg.
+    void HandleRequest(MsgType type, std::string& reqMsg, std::string& respMsg, ResponseBody& body);
+
+    // UPLOAD body is "name\0data": data is streamed into the blob root as it arrives,
+    // with a progress chunk every UPLOAD_PROGRESS_STEP bytes and the result in STREAM_END.
+    Task<void> HandleUpload(BodyReader& body, ChunkWriter& writer);
+
+    // Yields newline separated blob names starting with prefix, LIST_BATCH_BYTES per frame.
+    AsyncGenerator<std::string> HandleList(std::string prefix);
+
+    // Splits a BATCH payload into its sub-messages, false if the framing is broken.
+    static bool SplitBatch(const std::string& reqMsg, std::vector<std::pair<MsgHead, std::string_view>>& subs);
+
+    // Directory BLOB requests are served from, empty disables them.
+    static void SetBlobRoot(const std::string& root);
+
 private:
     void _HandleMsg(std::string& reqMsg, std::string& respMsg);
 
     void _HandleRequest(std::string& reqMsg, std::string& respMsg);
 
+    void _HandleGet(std::string& reqMsg, std::string& respMsg);
+
+    void _HandleSet(std::string& reqMsg, std::string& respMsg);
+
+    void _HandleDel(std::string& reqMsg, std::string& respMsg);
+
+    void _HandleMGet(std::string& reqMsg, std::string& respMsg);
+
+    void _HandleBatch(std::string& reqMsg, std::string& respMsg);
+
+    void _HandleBlob(std::string& reqMsg, std::string& respMsg, ResponseBody& body);
+
+    int _OpenBlob(const std::string& name, size_t& size);
+
+    bool _ValidBlobName(const std::string& name);
+
+    void _MakeStatus(bool ok, const std::string& text, std::string& respMsg);
+
     void _MakeErrResponse(std::string& respMsg);
 
 private:
     static std::atomic<uint32_t> _requestNum;
+
+    static std::string _blobRoot;
 };
\ No newline at end of file
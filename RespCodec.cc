@@ -0,0 +1,263 @@
+#include "RespCodec.h"
+#include "Logger.h"
+#include <cstring>
+#include <strings.h>
+
+namespace {
+
+bool IsCommand(const char* data, const std::pair<size_t, size_t>& arg, const char* name) {
+    return arg.second == strlen(name) && 0 == strncasecmp(data + arg.first, name, arg.second);
+}
+
+void AppendKey(std::string& payload, const char* data, const std::pair<size_t, size_t>& arg) {
+    uint32_t keyLen = arg.second;
+    payload.append((const char*)&keyLen, sizeof(keyLen));
+    payload.append(data + arg.first, arg.second);
+}
+
+}
+
+int64_t RespCodec::Decode(const char* data, size_t len, CodecRequest& req, std::string& payload) {
+    if(argc_ < 0) {
+        if(0 == len) {
+            return 0;
+        }
+        if('*' != data[0]) {
+            return _DecodeInline(data, len, req, payload);
+        }
+        int ret = _ParseLength(data, len, 1, argc_, pos_);
+        if(ret <= 0) {
+            argc_ = -1;
+            return ret;
+        }
+        if(argc_ < 1 || argc_ > MAX_ARGS) {
+            ERROR_LOG("resp array of %ld elements", argc_);
+            return -1;
+        }
+        args_.clear();
+    }
+
+    while((int64_t)args_.size() < argc_) {
+        if(pos_ >= len) {
+            return 0;
+        }
+        if('$' != data[pos_]) {
+            ERROR_LOG("resp expects a bulk string, got [%c]", data[pos_]);
+            return -1;
+        }
+        int64_t bulkLen = 0;
+        size_t start = 0;
+        int ret = _ParseLength(data, len, pos_ + 1, bulkLen, start);
+        if(ret <= 0) {
+            return ret;
+        }
+        if(bulkLen < 0 || bulkLen > maxFrame_) {
+            ERROR_LOG("resp bulk string len[%ld] out of range", bulkLen);
+            return -1;
+        }
+        if(len - start < (size_t)bulkLen + 2) {
+            return 0;
+        }
+        if('\r' != data[start + bulkLen] || '\n' != data[start + bulkLen + 1]) {
+            ERROR_LOG("resp bulk string not terminated by CRLF");
+            return -1;
+        }
+        args_.emplace_back(start, bulkLen);
+        pos_ = start + bulkLen + 2;
+    }
+
+    _MakeRequest(data, req, payload);
+    int64_t consumed = pos_;
+    argc_ = -1;
+    pos_  = 0;
+    return consumed;
+}
+
+int RespCodec::_ParseLength(const char* data, size_t len, size_t start, int64_t& value, size_t& end) {
+    auto cr = (const char*)memchr(data + start, '\r', std::min<size_t>(len - std::min(len, start), MAX_LINE));
+    if(!cr) {
+        return len - start >= MAX_LINE ? -1 : 0;
+    }
+    if(cr + 1 == data + len) {
+        return 0;
+    }
+    if('\n' != cr[1]) {
+        return -1;
+    }
+
+    const char* p = data + start;
+    bool negative = p < cr && '-' == *p;
+    if(negative) {
+        ++p;
+    }
+    if(p == cr || cr - p > 18) {
+        return -1;
+    }
+    value = 0;
+    for(; p < cr; ++p) {
+        if(*p < '0' || *p > '9') {
+            return -1;
+        }
+        value = value * 10 + (*p - '0');
+    }
+    if(negative) {
+        value = -value;
+    }
+    end = cr + 2 - data;
+    return 1;
+}
+
+int64_t RespCodec::_DecodeInline(const char* data, size_t len, CodecRequest& req, std::string& payload) {
+    auto lf = (const char*)memchr(data, '\n', std::min<size_t>(len, MAX_LINE));
+    if(!lf) {
+        return len >= MAX_LINE ? -1 : 0;
+    }
+    size_t lineLen = lf - data;
+    if(lineLen > 0 && '\r' == data[lineLen - 1]) {
+        --lineLen;
+    }
+
+    args_.clear();
+    for(size_t i = 0; i < lineLen;) {
+        if(' ' == data[i] || '\t' == data[i]) {
+            ++i;
+            continue;
+        }
+        size_t start = i;
+        while(i < lineLen && ' ' != data[i] && '\t' != data[i]) {
+            ++i;
+        }
+        args_.emplace_back(start, i - start);
+    }
+
+    if(args_.empty()) {
+        // a bare newline gets no reply
+        _LocalReply(req, payload, "");
+    } else {
+        _MakeRequest(data, req, payload);
+    }
+    return lf + 1 - data;
+}
+
+void RespCodec::_MakeRequest(const char* data, CodecRequest& req, std::string& payload) {
+    size_t argc = args_.size();
+    const auto& cmd = args_[0];
+    payload.clear();
+    req.local = false;
+
+    if(IsCommand(data, cmd, "GET") || IsCommand(data, cmd, "DEL")) {
+        if(2 != argc) {
+            _LocalReply(req, payload, "-ERR wrong number of arguments\r\n");
+            return;
+        }
+        bool get = IsCommand(data, cmd, "GET");
+        req.msgId = get ? CMD_GET : CMD_DEL;
+        req.type  = get ? MsgType::GET : MsgType::DEL;
+        payload.assign(data + args_[1].first, args_[1].second);
+    } else if(IsCommand(data, cmd, "SET")) {
+        if(3 != argc) {
+            // expiry and conditional options are not supported by the store
+            _LocalReply(req, payload, argc < 3 ? "-ERR wrong number of arguments\r\n" : "-ERR syntax error\r\n");
+            return;
+        }
+        req.msgId = CMD_SET;
+        req.type  = MsgType::SET;
+        payload.reserve(sizeof(uint32_t) + args_[1].second + args_[2].second);
+        AppendKey(payload, data, args_[1]);
+        payload.append(data + args_[2].first, args_[2].second);
+    } else if(IsCommand(data, cmd, "MGET")) {
+        if(argc < 2) {
+            _LocalReply(req, payload, "-ERR wrong number of arguments\r\n");
+            return;
+        }
+        req.msgId = CMD_MGET;
+        req.type  = MsgType::MGET;
+        for(size_t i = 1; i < argc; ++i) {
+            AppendKey(payload, data, args_[i]);
+        }
+    } else if(IsCommand(data, cmd, "PING")) {
+        if(argc > 1) {
+            std::string reply;
+            _AppendBulk(reply, std::string_view(data + args_[1].first, args_[1].second));
+            _LocalReply(req, payload, reply);
+        } else {
+            _LocalReply(req, payload, "+PONG\r\n");
+        }
+    } else if(IsCommand(data, cmd, "CONFIG") || IsCommand(data, cmd, "COMMAND")) {
+        // benchmarks probe these on connect, an empty answer tells them there is nothing to tune
+        _LocalReply(req, payload, "*0\r\n");
+    } else {
+        _LocalReply(req, payload, "-ERR unknown command '" + std::string(data + cmd.first, std::min<size_t>(cmd.second, 64)) + "'\r\n");
+    }
+}
+
+void RespCodec::_LocalReply(CodecRequest& req, std::string& payload, std::string_view reply) {
+    req.msgId = CMD_LOCAL;
+    req.type  = MsgType::UNKNOWN;
+    req.local = true;
+    payload.assign(reply);
+}
+
+void RespCodec::_AppendBulk(std::string& out, std::string_view value) {
+    out += '$';
+    out += std::to_string(value.length());
+    out += "\r\n";
+    out.append(value);
+    out += "\r\n";
+}
+
+void RespCodec::Encode(const CodecRequest& req, const std::string& respMsg, std::string& out) {
+    if(req.local) {
+        out += respMsg;
+        return;
+    }
+
+    bool ok = !respMsg.empty() && respMsg[0];
+    switch(req.msgId) {
+        case CMD_GET:
+            if(ok) {
+                _AppendBulk(out, std::string_view(respMsg).substr(sizeof(bool)));
+            } else {
+                out += "$-1\r\n";
+            }
+            break;
+        case CMD_SET:
+            out += ok ? "+OK\r\n" : "-ERR value rejected by the store\r\n";
+            break;
+        case CMD_DEL:
+            out += ok ? ":1\r\n" : ":0\r\n";
+            break;
+        case CMD_MGET: {
+            if(!ok) {
+                out += "-ERR malformed request\r\n";
+                break;
+            }
+            // the reply is true + repeated (i32 value len or -1, value)
+            std::string_view values(respMsg.data() + sizeof(bool), respMsg.length() - sizeof(bool));
+            size_t count = 0;
+            for(size_t pos = 0; pos + sizeof(int32_t) <= values.length(); ++count) {
+                int32_t valLen;
+                memcpy(&valLen, values.data() + pos, sizeof(valLen));
+                pos += sizeof(valLen) + std::max(0, valLen);
+            }
+            out += '*';
+            out += std::to_string(count);
+            out += "\r\n";
+            for(size_t pos = 0; pos + sizeof(int32_t) <= values.length();) {
+                int32_t valLen;
+                memcpy(&valLen, values.data() + pos, sizeof(valLen));
+                pos += sizeof(valLen);
+                if(valLen < 0) {
+                    out += "$-1\r\n";
+                } else {
+                    _AppendBulk(out, values.substr(pos, valLen));
+                    pos += valLen;
+                }
+            }
+            break;
+        }
+        default:
+            out += "-ERR internal error\r\n";
+            break;
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Codec.h"
+#include <string_view>
+#include <vector>
+
+// Redis protocol (RESP2) front end, enough for redis-cli, redis-benchmark and memtier:
+// GET, SET, DEL and MGET go to the KV handlers, PING, CONFIG and COMMAND are answered
+// here, anything else gets an error reply. Requests are arrays of bulk strings or
+// inline commands. The parse position survives a partial request, so a large SET is
+// scanned once no matter how many reads it takes to arrive.
+class RespCodec : public Codec {
+    static constexpr uint32_t MAX_ARGS = 1 << 20;
+    static constexpr uint32_t MAX_LINE = 64 << 10;     // inline command or length line
+public:
+    explicit RespCodec(uint32_t maxFrame) : maxFrame_(maxFrame) {}
+
+    int64_t Decode(const char* data, size_t len, CodecRequest& req, std::string& payload) override;
+
+    void Encode(const CodecRequest& req, const std::string& respMsg, std::string& out) override;
+
+private:
+    enum Command : uint32_t {
+        CMD_LOCAL = 0,
+        CMD_GET   = 1,
+        CMD_SET   = 2,
+        CMD_DEL   = 3,
+        CMD_MGET  = 4
+    };
+
+    // Parses the integer on the line starting at start, end is set past its CRLF.
+    int _ParseLength(const char* data, size_t len, size_t start, int64_t& value, size_t& end);
+
+    int64_t _DecodeInline(const char* data, size_t len, CodecRequest& req, std::string& payload);
+
+    void _MakeRequest(const char* data, CodecRequest& req, std::string& payload);
+
+    static void _LocalReply(CodecRequest& req, std::string& payload, std::string_view reply);
+
+    static void _AppendBulk(std::string& out, std::string_view value);
+
+private:
+    uint32_t maxFrame_;
+
+    int64_t argc_{-1};          // -1 until the array header of the current request is parsed
+
+    size_t pos_{0};             // bytes of the current request parsed so far
+
+    std::vector<std::pair<size_t, size_t>> args_;     // offset and length within the request
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Body bytes that follow the framed part of a response without passing through
+// user space: a file region goes out with sendfile, a pipe with splice.
+// A pipe must already hold len bytes when the response is sent.
+struct ResponseBody {
+    enum Kind {
+        NONE        = 0,
+        FILE_REGION = 1,
+        PIPE        = 2
+    };
+
+    Kind   kind{NONE};
+    int    fd{-1};
+    off_t  offset{0};
+    size_t len{0};
+
+    ResponseBody() = default;
+
+    ~ResponseBody() {
+        Reset();
+    }
+
+    ResponseBody(const ResponseBody&) = delete;
+    ResponseBody& operator=(const ResponseBody&) = delete;
+
+    ResponseBody(ResponseBody&& other) noexcept
+        : kind(std::exchange(other.kind, NONE)), fd(std::exchange(other.fd, -1)), offset(other.offset), len(std::exchange(other.len, 0)) {}
+
+    ResponseBody& operator=(ResponseBody&& other) noexcept {
+        if(this != &other) {
+            Reset();
+            kind   = std::exchange(other.kind, NONE);
+            fd     = std::exchange(other.fd, -1);
+            offset = other.offset;
+            len    = std::exchange(other.len, 0);
+        }
+        return *this;
+    }
+
+    void Reset() {
+        if(fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+        kind   = NONE;
+        offset = 0;
+        len    = 0;
+    }
+};
+
+struct Response {
+    std::string  frame;     // MsgHead plus the inline part of the body
+    ResponseBody body;
+};
@@ -0,0 +1,79 @@
+#include "ResponseCache.h"
+#include "Logger.h"
+#include <functional>
+#include <thread>
+
+ResponseCache::ResponseCache(size_t budget, std::chrono::milliseconds ttl, std::vector<MsgType> types, uint32_t shardNum)
+    : ttl_(ttl) {
+    // one shard per core keeps reactor threads on different cores off each other's locks
+    shardNum_ = shardNum ? shardNum : std::max(1u, std::thread::hardware_concurrency());
+    shards_.reset(new Shard[shardNum_]);
+    shardBudget_ = budget / shardNum_;
+    for(auto type : types) {
+        if(type < 32) {
+            typeMask_ |= 1u << type;
+        }
+    }
+    INFO_LOG("response cache budget[%lu] ttl[%ld ms] shards[%u] type mask[%x]", budget, (long)ttl.count(), shardNum_, typeMask_);
+}
+
+bool ResponseCache::Cacheable(MsgType type) const {
+    return type < 32 && (typeMask_ & (1u << type));
+}
+
+uint64_t ResponseCache::_Hash(MsgType type, const std::string& payload) {
+    uint64_t hash = std::hash<std::string_view>{}(payload);
+    return hash ^ ((uint64_t)type * 0x9e3779b97f4a7c15ull);
+}
+
+bool ResponseCache::Lookup(MsgType type, const std::string& payload, Frame& frame) {
+    uint64_t hash = _Hash(type, payload);
+    Shard& shard = _ShardOf(hash);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto itr = shard.entries.find(hash);
+    if(itr == shard.entries.end() || itr->second.type != type || itr->second.payload != payload) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if(itr->second.expire <= std::chrono::steady_clock::now()) {
+        _Erase(shard, itr);
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    shard.lru.splice(shard.lru.begin(), shard.lru, itr->second.lruPos);
+    frame = itr->second.frame;
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void ResponseCache::Insert(MsgType type, const std::string& payload, const std::string& frame) {
+    uint64_t hash = _Hash(type, payload);
+    Shard& shard = _ShardOf(hash);
+    Entry entry{type, payload, std::make_shared<const std::string>(frame), std::chrono::steady_clock::now() + ttl_, {}};
+    size_t cost = _Cost(entry);
+    if(cost > shardBudget_) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto itr = shard.entries.find(hash);
+    if(itr != shard.entries.end()) {
+        // same key refreshed, or a hash collision: the newer entry wins
+        _Erase(shard, itr);
+    }
+    while(shard.usedBytes + cost > shardBudget_ && !shard.lru.empty()) {
+        _Erase(shard, shard.entries.find(shard.lru.back()));
+    }
+
+    shard.lru.push_front(hash);
+    entry.lruPos = shard.lru.begin();
+    shard.usedBytes += cost;
+    shard.entries.emplace(hash, std::move(entry));
+}
+
+void ResponseCache::_Erase(Shard& shard, std::unordered_map<uint64_t, Entry>::iterator itr) {
+    shard.usedBytes -= _Cost(itr->second);
+    shard.lru.erase(itr->second.lruPos);
+    shard.entries.erase(itr);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "MsgType.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Opt-in cache of complete reply frames for request types whose reply only
+// depends on the payload. Entries are keyed by (type, payload), expire after
+// ttl and are evicted LRU once a shard exceeds its share of the budget. The
+// stored frame is sent as is, only its msgId is replaced on the wire.
+class ResponseCache {
+    static constexpr uint32_t ENTRY_OVERHEAD = 64;
+public:
+    using Frame = std::shared_ptr<const std::string>;
+
+    ResponseCache(size_t budget, std::chrono::milliseconds ttl, std::vector<MsgType> types, uint32_t shardNum = 0);
+
+    bool Cacheable(MsgType type) const;
+
+    bool Lookup(MsgType type, const std::string& payload, Frame& frame);
+
+    void Insert(MsgType type, const std::string& payload, const std::string& frame);
+
+    uint64_t Hits() const { return hits_.load(std::memory_order_relaxed); }
+
+    uint64_t Misses() const { return misses_.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry {
+        MsgType type;
+        std::string payload;
+        Frame frame;
+        std::chrono::steady_clock::time_point expire;
+        std::list<uint64_t>::iterator lruPos;
+    };
+
+    struct alignas(64) Shard {
+        std::mutex lock;
+        std::unordered_map<uint64_t, Entry> entries;
+        std::list<uint64_t> lru;        // front is most recently used
+        size_t usedBytes{0};
+    };
+
+    static uint64_t _Hash(MsgType type, const std::string& payload);
+
+    Shard& _ShardOf(uint64_t hash) { return shards_[hash % shardNum_]; }
+
+    void _Erase(Shard& shard, std::unordered_map<uint64_t, Entry>::iterator itr);
+
+    static size_t _Cost(const Entry& entry) { return entry.payload.length() + entry.frame->length() + ENTRY_OVERHEAD; }
+
+private:
+    std::unique_ptr<Shard[]> shards_;
+
+    uint32_t shardNum_{1};
+
+    size_t shardBudget_{0};
+
+    std::chrono::milliseconds ttl_;
+
+    uint32_t typeMask_{0};
+
+    std::atomic<uint64_t> hits_{0};
+
+    std::atomic<uint64_t> misses_{0};
+};
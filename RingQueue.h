@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// FIFO on a power-of-two ring that only ever grows. Unlike std::deque it does not free and
+// reallocate blocks as the head and tail move along, so a queue cycling at a steady depth
+// stays off the heap.
+template <typename T>
+class RingQueue {
+    static constexpr size_t INITIAL_SIZE = 64;
+public:
+    bool empty() const { return 0 == size_; }
+
+    size_t size() const { return size_; }
+
+    T& front() { return slots_[head_]; }
+
+    // i counts from the front.
+    T& operator[](size_t i) { return slots_[(head_ + i) & (slots_.size() - 1)]; }
+
+    template <typename... Args>
+    void emplace_back(Args&&... args) {
+        if(size_ == slots_.size()) {
+            _Grow();
+        }
+        slots_[(head_ + size_) & (slots_.size() - 1)] = T(std::forward<Args>(args)...);
+        ++size_;
+    }
+
+    void pop_front() {
+        head_ = (head_ + 1) & (slots_.size() - 1);
+        --size_;
+    }
+
+    void clear() {
+        head_ = 0;
+        size_ = 0;
+    }
+
+    // Removes the entries pred holds for, keeping the order of the rest. Returns how many went.
+    template <typename Pred>
+    size_t EraseIf(Pred pred) {
+        size_t kept = 0;
+        for(size_t i = 0; i < size_; ++i) {
+            T& entry = (*this)[i];
+            if(!pred(entry)) {
+                if(kept != i) {
+                    (*this)[kept] = std::move(entry);
+                }
+                ++kept;
+            }
+        }
+        size_t erased = size_ - kept;
+        size_ = kept;
+        return erased;
+    }
+
+private:
+    void _Grow() {
+        std::vector<T> slots(slots_.empty() ? INITIAL_SIZE : slots_.size() * 2);
+        for(size_t i = 0; i < size_; ++i) {
+            slots[i] = std::move((*this)[i]);
+        }
+        slots_.swap(slots);
+        head_ = 0;
+    }
+
+private:
+    std::vector<T> slots_;
+    size_t head_{0};
+    size_t size_{0};
+};
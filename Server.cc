@@ -1,6 +1,6 @@
 #include "Server.h"
+#include "ConnectionEngine.h"
 #include "Logger.h"
-#include "RequestHandler.h"
 #include <cerrno>
 #include <cstdio>
 #include <netinet/tcp.h> 
@@ -35,48 +35,9 @@ Server* Server::GetInstance() {
 }
 
 bool Server::Start() {
-    _serverFd = socket(AF_INET, SOCK_STREAM, 0);
-    if(-1 == _serverFd) {
-        ERROR_LOG("create socket failed, errno: %d, error: %s\n", errno, strerror(errno));
-        return false;
-    }
-
-    int32_t flags = fcntl(_serverFd, F_GETFL, 0);
-    if(-1 == flags) {
-        ERROR_LOG("fcntl get flags failed, errno: %d, error: %s\n", errno, strerror(errno));
-        return false;
-    }
-
-    flags |= O_NONBLOCK;
-    if(-1 == fcntl(_serverFd, F_SETFL, flags)) {
-        ERROR_LOG("fcntl set nonblock failed, errno: %d, error: %s\n", errno, strerror(errno));
-        return false;
-    }
-
-    int32_t opt = 1;
-    if(-1 == setsockopt(_serverFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-        ERROR_LOG("setsockopt SO_REUSEADDR failed, errno: %d, error: %s\n", errno, strerror(errno));
-        return false;
-    }
-    
-    if(-1 == setsockopt(_serverFd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt))) {
-        ERROR_LOG("setsockopt TCP_NODELAY failed, errno: %d, error: %s\n", errno, strerror(errno));
-        return false;
-    }
-
-    struct sockaddr_in serverAddress;
-    memset(&serverAddress, 0, sizeof(serverAddress));
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_addr.s_addr = INADDR_ANY;
-    serverAddress.sin_port = htons(PORT);
-
-    if(-1 == bind(_serverFd, (struct sockaddr *)&serverAddress, sizeof(serverAddress))) {
-        ERROR_LOG("bind failed, errno: %d, error: %s\n", errno, strerror(errno));
-        return false;
-    }
-
-    if(-1 == listen(_serverFd, 10)) {   
-        ERROR_LOG("listen failed, errno: %d, error: %s\n", errno, strerror(errno));
+    // same listener setup as the coroutine front end
+    _serverFd = CreateListenSocket(ListenerConfig{AF_INET, "", PORT});
+    if(INVALID_SOCKET_VALUE == _serverFd) {
         return false;
     }
 
@@ -220,7 +181,7 @@ bool Server::_InitChildProcess() {
 
     // 将客户端套接字添加到epoll
     struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLOUT;
+    ev.events = EPOLLIN;
     ev.data.fd = _clientFd;
     if(-1 == epoll_ctl(_epollFd, EPOLL_CTL_ADD, _clientFd, &ev)) {
         ERROR_LOG("child process epoll_ctl add clientfd failed, errno: %d, error: %s\n", errno, strerror(errno));
@@ -237,124 +198,97 @@ bool Server::_InitChildProcess() {
 }
 
 void Server::_HandleRequest() {
+    // framing, the frame size check and dispatch are the engine's, shared with AsyncServer
+    Connection conn(CODEC_MSG_HEAD, BUFFER_SIZE);
     while(true) {
-        struct epoll_event events[MAX_EVENTS];
-        int32_t nfds = epoll_wait(_epollFd, events, MAX_EVENTS, -1);
-        if(-1 == nfds) {
-            if(errno == EINTR) {
+        auto len = read(_clientFd, _buffer + _usedBuf, BUFFER_SIZE - _usedBuf);
+        if(len < 0) {
+            if(EINTR == errno) {
+                DEBUG_LOG("read failed caused by interrupt errno: %d, error: %s, read again\n", errno, strerror(errno));
+                continue;
+            } else if(EAGAIN == errno || EWOULDBLOCK == errno) {
+                DEBUG_LOG("read failed no data read, errno: %d, errno: %s, wait again\n", errno, strerror(errno));
+                if(!_WaitFor(EPOLLIN)) {
+                    return;
+                }
                 continue;
-            } else {
-                DEBUG_LOG("epoll_wait failed, errno: %d, error: %s\n", errno, strerror(errno));
-                return;
             }
+            ERROR_LOG("read failed errno: %d, error: %s\n", errno, strerror(errno));
+            return;
+        } else if(0 == len) {
+            INFO_LOG("peer closed the connection\n");
+            return;
         }
 
-        for(int i = 0; i < nfds; ++i) {
-            if(events[i].data.fd == _clientFd && (events[i].events & EPOLLIN)) {
-                uint32_t readLen = _pHead != nullptr ? _pHead->dataLen - _usedBuf + sizeof(MsgHead) : sizeof(MsgHead) - _usedBuf;
-                while(readLen > 0) {
-                    auto len = read(_clientFd, _buffer + _usedBuf, readLen);
-                    if(len < 0) {
-                        if(EINTR == errno) {
-                            DEBUG_LOG("read failed caused by interrupt errno: %d, error: %s, read again\n", errno, strerror(errno));
-                            continue;
-                        } else if(EAGAIN == errno || EWOULDBLOCK == errno) {
-                            DEBUG_LOG("read failed no data read, errno: %d, errno: %s, wait again\n", errno, strerror(errno));
-                            break;
-                        } else {
-                            ERROR_LOG("read failed errno: %d, error: %s\n", errno, strerror(errno));
-                            break;
-                        }
-                    } else if(0 == len) {
-                        INFO_LOG("peer closed the connection\n");
-                        return;
-                    }
-
-                    _usedBuf += len;
-                    readLen  -= len;
-                    if(_usedBuf < sizeof(MsgHead)) {
-                        continue;
-                    } else if(sizeof(MsgHead) == _usedBuf) {
-                        _pHead = reinterpret_cast<PMsgHead>(_buffer);
-                        if(_pHead->dataLen + sizeof(MsgHead) > BUFFER_SIZE) {
-                            ERROR_LOG("request data len: %u larger than max buffer size: %u\n", 
-                                    _pHead->dataLen + (uint32_t)sizeof(MsgHead), BUFFER_SIZE);
-                            return;
-                        }
-                    } else if(_usedBuf - sizeof(MsgHead) < _pHead->dataLen) {
-                        continue;
-                    } else {
-                        INFO_LOG("receive all request data, dataLen: %u, recevie len: %u\n", 
-                                _pHead->dataLen, _usedBuf - (uint32_t)sizeof(MsgHead));
-
-                        RequestHandler handler;
-                        std::string reqMsg(_pHead->dataLen, '\0');
-                        memcpy(reqMsg.data(), _buffer + sizeof(MsgHead), _pHead->dataLen);
-                        std::string respMsg;
-                        handler.HandleRequest(_pHead->type, reqMsg, respMsg);
+        _usedBuf += len;
+        auto parsed = conn.Serve(_buffer, _usedBuf);
+        if(parsed < 0) {
+            ERROR_LOG("malformed request, drop connection\n");
+            return;
+        }
+        // keep the partial request at the front of the buffer
+        memmove(_buffer, _buffer + parsed, _usedBuf - parsed);
+        _usedBuf -= parsed;
 
-                        std::string response;
-                        _MakeResponse(_pHead->msgId, _pHead->type, respMsg, response);
-                        _SendResponse(response);
-                        
-                        _usedBuf = 0;
-                        _pHead = nullptr;
-                    } 
-                }
+        auto& out = conn.Out();
+        if(!out.empty()) {
+            if(!_SendResponse(out)) {
+                return;
             }
+            out.clear();
         }
     }
 }
 
-void Server::_MakeResponse(uint32_t msgId, MsgType type, const std::string& respMsg, std::string& response) {
-    uint32_t totalLen = sizeof(MsgHead) + respMsg.length();
-    response.resize(totalLen);
-
-    auto head = (PMsgHead)response.data();
-    head->msgId   = msgId;
-    head->type    = type;
-    head->dataLen = respMsg.length();
+bool Server::_WaitFor(uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = _clientFd;
+    if(-1 == epoll_ctl(_epollFd, EPOLL_CTL_MOD, _clientFd, &ev)) {
+        ERROR_LOG("epoll_ctl mod clientfd failed, errno: %d, error: %s\n", errno, strerror(errno));
+        return false;
+    }
 
-    memcpy(response.data() + sizeof(MsgHead), respMsg.data(), respMsg.length());
+    struct epoll_event readyEvents[MAX_EVENTS];
+    while(true) {
+        int32_t nfds = epoll_wait(_epollFd, readyEvents, MAX_EVENTS, -1);
+        if(-1 == nfds) {
+            if(EINTR == errno) {
+                continue;
+            }
+            ERROR_LOG("epoll_wait failed, errno: %d, error: %s\n", errno, strerror(errno));
+            return false;
+        }
+        for(int32_t i = 0; i < nfds; ++i) {
+            // a hang up or error shows up in the next read or write
+            if(readyEvents[i].data.fd == _clientFd) {
+                return true;
+            }
+        }
+    }
 }
 
-void Server::_SendResponse(const std::string& response) {
+bool Server::_SendResponse(const std::string& response) {
     uint32_t totalLen = response.length();
     uint32_t writeLen = 0;
-
-    struct epoll_event events[10];
     while(writeLen < totalLen) {
-        auto nfds = epoll_wait(_epollFd, events, 10, 1000);
-        if(nfds < 0) {
+        auto len = write(_clientFd, response.data() + writeLen, totalLen - writeLen);
+        if(len < 0) {
             if(EINTR == errno) {
                 continue;
-            }
-            ERROR_LOG("epoll wait failed, errno: %d, error: %s\n", errno, strerror(errno));
-            return;
-        } else if(0 == nfds) {
-            continue;
-        }
-
-        for(auto i = 0; i < nfds; ++i) {
-            if(events[i].data.fd == _clientFd && (events[i].events & EPOLLOUT)) {
-                while(true) {
-                    auto len = write(_clientFd, response.data() + writeLen, totalLen - writeLen);
-                    if(len < 0) {
-                        if(EINTR == errno) {
-                            continue;
-                        } else if(EAGAIN == errno || EWOULDBLOCK == errno) {
-                            break;
-                        }
-
-                        ERROR_LOG("write socket failed, errno: %d, error: %s\n", errno, strerror(errno));
-                        return;
-                    }
-
-                    INFO_LOG("write data len: %u, data len: %u, total len: %u\n", (uint32_t)len, (uint32_t)(totalLen - sizeof(MsgHead)), totalLen);
-                    writeLen += len;
-                    break;
+            } else if(EAGAIN == errno || EWOULDBLOCK == errno) {
+                if(!_WaitFor(EPOLLOUT)) {
+                    return false;
                 }
+                continue;
             }
+
+            ERROR_LOG("write socket failed, errno: %d, error: %s\n", errno, strerror(errno));
+            return false;
         }
+
+        INFO_LOG("write data len: %u, total len: %u\n", (uint32_t)len, totalLen);
+        writeLen += len;
     }
-}
\ No newline at end of file
+    return true;
+}
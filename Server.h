@@ -32,9 +32,10 @@ private:
 
     bool _InitChildProcess();
 
-    void _MakeResponse(uint32_t msgId, MsgType type, const std::string& respMsg, std::string& response);
+    // Blocks in epoll until the client socket is ready for events, false on an epoll error.
+    bool _WaitFor(uint32_t events);
 
-    void _SendResponse(const std::string& response);
+    bool _SendResponse(const std::string& response);
 
 private:
     int32_t _serverFd{-1};
@@ -43,9 +44,7 @@ private:
 
     int32_t _epollFd{-1};
 
-    char* _buffer;
+    char* _buffer{nullptr};
 
     uint32_t _usedBuf{0};
-
-    PMsgHead _pHead{nullptr};
 };
\ No newline at end of file
@@ -0,0 +1,268 @@
+#include "ShmTransport.h"
+#include "Logger.h"
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool ShmRing::Push(uint32_t msgId, MsgType type, const char* data, uint32_t dataLen) {
+    if(!HasRoom(dataLen)) {
+        return false;
+    }
+
+    uint64_t tail = ctrl_->tail.load(std::memory_order_relaxed);
+    MsgHead head{msgId, type, dataLen};
+    _CopyIn(tail, (const char*)&head, sizeof(MsgHead));
+    _CopyIn(tail + sizeof(MsgHead), data, dataLen);
+    ctrl_->tail.store(tail + sizeof(MsgHead) + dataLen, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return true;
+}
+
+bool ShmRing::Pop(MsgHead& head, std::string& data) {
+    if(!HasFrame()) {
+        return false;
+    }
+
+    uint64_t pos = ctrl_->head.load(std::memory_order_relaxed);
+    _CopyOut(pos, (char*)&head, sizeof(MsgHead));
+    data.resize(head.dataLen);
+    _CopyOut(pos + sizeof(MsgHead), data.data(), head.dataLen);
+    ctrl_->head.store(pos + sizeof(MsgHead) + head.dataLen, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return true;
+}
+
+bool ShmRing::HasFrame() const {
+    // the producer publishes whole frames, so any pending byte means a full frame
+    return ctrl_->tail.load(std::memory_order_acquire) != ctrl_->head.load(std::memory_order_relaxed);
+}
+
+bool ShmRing::HasRoom(uint32_t dataLen) const {
+    uint64_t used = ctrl_->tail.load(std::memory_order_relaxed) - ctrl_->head.load(std::memory_order_acquire);
+    return used + sizeof(MsgHead) + dataLen <= Capacity();
+}
+
+bool ShmRing::ArmConsumerWait() {
+    ctrl_->consumerWaiting.store(1, std::memory_order_seq_cst);
+    if(HasFrame()) {
+        DisarmConsumerWait();
+        return false;
+    }
+    return true;
+}
+
+bool ShmRing::ArmProducerWait(uint32_t dataLen) {
+    ctrl_->producerWaiting.store(1, std::memory_order_seq_cst);
+    if(HasRoom(dataLen)) {
+        DisarmProducerWait();
+        return false;
+    }
+    return true;
+}
+
+void ShmRing::DisarmConsumerWait() {
+    ctrl_->consumerWaiting.store(0, std::memory_order_relaxed);
+}
+
+void ShmRing::DisarmProducerWait() {
+    ctrl_->producerWaiting.store(0, std::memory_order_relaxed);
+}
+
+bool ShmRing::ConsumerWaiting() const {
+    return ctrl_->consumerWaiting.load(std::memory_order_seq_cst) != 0;
+}
+
+bool ShmRing::ProducerWaiting() const {
+    return ctrl_->producerWaiting.load(std::memory_order_seq_cst) != 0;
+}
+
+void ShmRing::_CopyIn(uint64_t pos, const char* src, uint32_t len) {
+    uint32_t off   = pos & mask_;
+    uint32_t first = std::min(len, Capacity() - off);
+    memcpy(data_ + off, src, first);
+    memcpy(data_, src + first, len - first);
+}
+
+void ShmRing::_CopyOut(uint64_t pos, char* dst, uint32_t len) const {
+    uint32_t off   = pos & mask_;
+    uint32_t first = std::min(len, Capacity() - off);
+    memcpy(dst, data_ + off, first);
+    memcpy(dst + first, data_, len - first);
+}
+
+ShmChannel::~ShmChannel() {
+    if(base) {
+        munmap(base, mapLen);
+        base = nullptr;
+    }
+    for(int* fd : {&memFd, &serverEventFd, &clientEventFd}) {
+        if(*fd != -1) {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+bool ShmChannel::Create(uint32_t ringSize) {
+    if(ringSize < 2 * sizeof(MsgHead) || (ringSize & (ringSize - 1)) != 0) {
+        ERROR_LOG("shm ring size[%u] must be a power of two", ringSize);
+        return false;
+    }
+
+    memFd = memfd_create("server_shm_ring", MFD_CLOEXEC);
+    if(-1 == memFd) {
+        ERROR_LOG("memfd_create failed, errno: %d, error: %s", errno, strerror(errno));
+        return false;
+    }
+
+    if(-1 == ftruncate(memFd, 2 * sizeof(ShmRingCtrl) + 2 * (size_t)ringSize)) {
+        ERROR_LOG("ftruncate shm failed, errno: %d, error: %s", errno, strerror(errno));
+        return false;
+    }
+
+    serverEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    clientEventFd = eventfd(0, EFD_CLOEXEC);
+    if(-1 == serverEventFd || -1 == clientEventFd) {
+        ERROR_LOG("eventfd failed, errno: %d, error: %s", errno, strerror(errno));
+        return false;
+    }
+
+    return _Map(ringSize, true);
+}
+
+bool ShmChannel::Attach(int mem, int serverEvt, int clientEvt, uint32_t ringSize) {
+    memFd         = mem;
+    serverEventFd = serverEvt;
+    clientEventFd = clientEvt;
+    return _Map(ringSize, false);
+}
+
+bool ShmChannel::_Map(uint32_t ringSize, bool init) {
+    mapLen = 2 * sizeof(ShmRingCtrl) + 2 * (size_t)ringSize;
+    base = mmap(nullptr, mapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, memFd, 0);
+    if(MAP_FAILED == base) {
+        base = nullptr;
+        ERROR_LOG("mmap shm failed, errno: %d, error: %s", errno, strerror(errno));
+        return false;
+    }
+
+    auto reqCtrl  = reinterpret_cast<ShmRingCtrl*>(base);
+    auto respCtrl = reqCtrl + 1;
+    if(init) {
+        new (reqCtrl) ShmRingCtrl();
+        new (respCtrl) ShmRingCtrl();
+    }
+
+    char* data = reinterpret_cast<char*>(respCtrl + 1);
+    reqRing  = ShmRing(reqCtrl, data, ringSize);
+    respRing = ShmRing(respCtrl, data + ringSize, ringSize);
+    return true;
+}
+
+void ShmChannel::Wake(int eventFd) {
+    uint64_t one = 1;
+    if(write(eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        WARN_LOG("write eventfd[%d] failed, errno: %d, error: %s", eventFd, errno, strerror(errno));
+    }
+}
+
+void ShmChannel::Drain(int eventFd) {
+    uint64_t cnt = 0;
+    while(read(eventFd, &cnt, sizeof(cnt)) < 0 && errno == EINTR) {}
+}
+
+ShmClient::~ShmClient() {
+    Close();
+}
+
+void ShmClient::Close() {
+    if(ctrlFd_ != -1) {
+        close(ctrlFd_);
+        ctrlFd_ = -1;
+    }
+}
+
+bool ShmClient::Connect(const std::string& path) {
+    ctrlFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(-1 == ctrlFd_) {
+        ERROR_LOG("create unix socket failed, errno: %d, error: %s", errno, strerror(errno));
+        return false;
+    }
+
+    struct sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if(path.length() >= sizeof(addr.sun_path)) {
+        ERROR_LOG("unix socket path[%s] too long", path.c_str());
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.length());
+    if(-1 == connect(ctrlFd_, (struct sockaddr*)&addr, sizeof(addr))) {
+        ERROR_LOG("connect shm server[%s] failed, errno: %d, error: %s", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+
+    ShmHandshake hs{};
+    struct iovec iov{&hs, sizeof(hs)};
+    char ctrlBuf[CMSG_SPACE(3 * sizeof(int))];
+    struct msghdr msg{};
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctrlBuf;
+    msg.msg_controllen = sizeof(ctrlBuf);
+    if(recvmsg(ctrlFd_, &msg, MSG_CMSG_CLOEXEC) != sizeof(hs)) {
+        ERROR_LOG("recv shm handshake failed, errno: %d, error: %s", errno, strerror(errno));
+        return false;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        ERROR_LOG("shm handshake carries no fds");
+        return false;
+    }
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if(hs.magic != SHM_MAGIC || hs.version != SHM_VERSION) {
+        ERROR_LOG("shm handshake magic[%x] version[%u] mismatch", hs.magic, hs.version);
+        for(int fd : fds) {
+            close(fd);
+        }
+        return false;
+    }
+
+    return channel_.Attach(fds[0], fds[1], fds[2], hs.ringSize);
+}
+
+bool ShmClient::Call(uint32_t msgId, MsgType type, const std::string& reqMsg, MsgHead& respHead, std::string& respMsg) {
+    auto& reqRing  = channel_.reqRing;
+    auto& respRing = channel_.respRing;
+    if(!reqRing.Fits(reqMsg.length())) {
+        ERROR_LOG("request len[%lu] exceeds shm ring size[%u]", reqMsg.length(), reqRing.Capacity());
+        return false;
+    }
+
+    while(!reqRing.Push(msgId, type, reqMsg.data(), reqMsg.length())) {
+        if(reqRing.ArmProducerWait(reqMsg.length())) {
+            ShmChannel::Drain(channel_.clientEventFd);
+            reqRing.DisarmProducerWait();
+        }
+    }
+    if(reqRing.ConsumerWaiting()) {
+        ShmChannel::Wake(channel_.serverEventFd);
+    }
+
+    while(!respRing.Pop(respHead, respMsg)) {
+        if(respRing.ArmConsumerWait()) {
+            ShmChannel::Drain(channel_.clientEventFd);
+            respRing.DisarmConsumerWait();
+        }
+    }
+    if(respRing.ProducerWaiting()) {
+        ShmChannel::Wake(channel_.serverEventFd);
+    }
+    return true;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "MsgType.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+const uint32_t SHM_MAGIC   = 0x53484d52;
+const uint32_t SHM_VERSION = 1;
+
+// Control block of one ring, placed at the start of the shared mapping. head/tail
+// are byte positions that only grow; the two sides never write the same line.
+struct ShmRingCtrl {
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<uint32_t> consumerWaiting{0};
+    std::atomic<uint32_t> producerWaiting{0};
+};
+
+// Sent with the fds (memfd, server eventfd, client eventfd) during the handshake.
+struct ShmHandshake {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ringSize;
+};
+
+// Single-producer/single-consumer ring of MsgHead framed messages.
+class ShmRing {
+public:
+    ShmRing() = default;
+
+    ShmRing(ShmRingCtrl* ctrl, char* data, uint32_t size) : ctrl_(ctrl), data_(data), mask_(size - 1) {}
+
+    uint32_t Capacity() const { return mask_ + 1; }
+
+    bool Fits(uint32_t dataLen) const { return sizeof(MsgHead) + (uint64_t)dataLen <= Capacity(); }
+
+    bool Push(uint32_t msgId, MsgType type, const char* data, uint32_t dataLen);
+
+    bool Pop(MsgHead& head, std::string& data);
+
+    bool HasFrame() const;
+
+    bool HasRoom(uint32_t dataLen) const;
+
+    // Both return false when the wait is unnecessary because the condition already holds.
+    bool ArmConsumerWait();
+
+    bool ArmProducerWait(uint32_t dataLen);
+
+    void DisarmConsumerWait();
+
+    void DisarmProducerWait();
+
+    bool ConsumerWaiting() const;
+
+    bool ProducerWaiting() const;
+
+private:
+    void _CopyIn(uint64_t pos, const char* src, uint32_t len);
+
+    void _CopyOut(uint64_t pos, char* dst, uint32_t len) const;
+
+private:
+    ShmRingCtrl* ctrl_{nullptr};
+
+    char* data_{nullptr};
+
+    uint32_t mask_{0};
+};
+
+// One client's mapping: a request ring (client -> server) and a response ring
+// (server -> client). Each side sleeps on its own eventfd and is only signalled
+// when it announced that it is waiting.
+struct ShmChannel {
+    int memFd{-1};
+    int serverEventFd{-1};
+    int clientEventFd{-1};
+    void* base{nullptr};
+    size_t mapLen{0};
+    ShmRing reqRing;
+    ShmRing respRing;
+    bool closed{false};
+
+    ShmChannel() = default;
+    ~ShmChannel();
+
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator=(const ShmChannel&) = delete;
+
+    bool Create(uint32_t ringSize);
+
+    bool Attach(int mem, int serverEvt, int clientEvt, uint32_t ringSize);
+
+    static void Wake(int eventFd);
+
+    static void Drain(int eventFd);
+
+private:
+    bool _Map(uint32_t ringSize, bool init);
+};
+
+// Blocking client side of the shared-memory transport.
+class ShmClient {
+public:
+    ShmClient() = default;
+    ~ShmClient();
+
+    bool Connect(const std::string& path);
+
+    bool Call(uint32_t msgId, MsgType type, const std::string& reqMsg, MsgHead& respHead, std::string& respMsg);
+
+    void Close();
+
+private:
+    int ctrlFd_{-1};
+
+    ShmChannel channel_;
+};
@@ -1,25 +1,93 @@
 #include "CoroutineServer.h"
 #include "Server.h"
 #include "Logger.h"
+#include "RequestHandler.h"
+#include "KvStore.h"
+#include "LocalBench.h"
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <numeric>
 
 spdlog::level::level_enum log_level = spdlog::level::info;
 
-int main() {
+// --local-bench [requests] [depth] [connections]: drive the sessions in-process and exit,
+// nothing is bound and logging is off so the numbers are the request path alone
+int LocalBenchMain(int argc, char** argv) {
+    log_level = spdlog::level::trace;
+    LocalBenchConfig config;
+    if(argc > 2) {
+        config.requests = strtoull(argv[2], nullptr, 10);
+    }
+    if(argc > 3) {
+        config.depth = strtoul(argv[3], nullptr, 10);
+    }
+    if(argc > 4) {
+        config.connections = strtoul(argv[4], nullptr, 10);
+    }
+
+    AsyncServer server;
+    LocalBenchResult result;
+    bool ok = RunLocalBench(server, config, result);
+    double perReq = result.requests ? 1.0 / result.requests : 0;
+    printf("requests %lu failed %lu ticks %lu wall %.3f ms cpu %.3f ms cpu/request %.0f ns\n",
+           (unsigned long)result.requests, (unsigned long)result.failed, (unsigned long)result.ticks,
+           result.wall.count() / 1e6, result.cpu.count() / 1e6, result.cpu.count() * perReq);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char** argv) {
     std::string errMsg;
     if(!Logger::Instance()->Init("server.log", "", false,  errMsg)) {
         printf("Init logger failed, %s", errMsg.c_str());
         return -1;
     }
     
+    RequestHandler::SetBlobRoot("./blobs");
+    KvStore::Instance()->Init(KvStore::DEFAULT_BUDGET, KvStore::DEFAULT_SHARDS);
+
+    if(argc > 1 && 0 == strcmp(argv[1], "--local-bench")) {
+        return LocalBenchMain(argc, argv);
+    }
+
     AsyncServer server;
-    auto start = server.StartServer(9999);
-    if(!start.get()) {
-        ERROR_LOG("start server failed");
+    // a running instance hands its listeners and connections over, otherwise start fresh
+    bool upgraded = server.TakeOver("/tmp/coroutine_server_upgrade.sock");
+    if(!upgraded) {
+        auto start = server.StartServer(9999);
+        if(!start.get()) {
+            ERROR_LOG("start server failed");
+            return -1;
+        }
+    }
+
+    if(!server.EnableJournal("server_msg.journal")) {
+        ERROR_LOG("open msg journal failed");
         return -1;
     }
 
+    if(!upgraded && !server.AddListener(ListenerConfig{AF_INET6, "", 9999})) {
+        WARN_LOG("start ipv6 listener failed");
+    }
+
+    if(!upgraded && !server.AddListener(ListenerConfig{AF_UNIX, "/tmp/coroutine_server_stream.sock", 0})) {
+        WARN_LOG("start unix stream listener failed");
+    }
+
+    // redis-cli, redis-benchmark and memtier talk to the KV store through this one
+    if(!upgraded && !server.AddListener(ListenerConfig{AF_INET, "", 6379, CODEC_RESP})) {
+        WARN_LOG("start resp listener failed");
+    }
+
+    if(!server.StartShmListener("/tmp/coroutine_server.sock")) {
+        WARN_LOG("start shm listener failed, local clients fall back to tcp");
+    }
+
+    // the next binary takes over from here, this one exits once it drained
+    if(!server.EnableHotUpgrade("/tmp/coroutine_server_upgrade.sock")) {
+        WARN_LOG("start upgrade listener failed, restarts drop connections");
+    }
+
     server.RunServer();
 
     // if(!Server::GetInstance()->Start()) {